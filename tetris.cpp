@@ -1,8 +1,95 @@
+#include <SFML/Audio.hpp>
 #include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <map>
 #include <iostream>
 #include <fstream>
 #include <ostream>
+#include <sstream>
+#include <thread>
 #include <time.h>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "retro_ttf.h" // retro.ttf embedded by the Makefile
+
+// Seedable pseudo-random numbers (xorshift32), so a game can be replayed from its seed
+class Random
+{
+public:
+    unsigned state;
+
+    Random(unsigned seed = 1)
+    {
+        setSeed(seed);
+    }
+
+    void setSeed(unsigned seed)
+    {
+        state = seed ? seed : 0x9E3779B9;
+    }
+
+    // Returns a number in [0, n)
+    int next(int n)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % n;
+    }
+};
+
+// Non-owning view of characters, for parsing text in place (C++11 has no std::string_view)
+class StringView
+{
+public:
+    const char *data;
+    size_t size;
+
+    StringView() : data(NULL), size(0) {}
+    StringView(const char *data, size_t size) : data(data), size(size) {}
+
+    bool empty() const
+    {
+        return size == 0;
+    }
+
+    char front() const
+    {
+        return data[0];
+    }
+
+    StringView substr(size_t position) const
+    {
+        return position < size ? StringView(data + position, size - position) : StringView();
+    }
+
+    bool startsWith(const char *prefix) const
+    {
+        size_t length = strlen(prefix);
+        return length <= size and memcmp(data, prefix, length) == 0;
+    }
+
+    // Removes and returns everything up to the next newline, which is dropped too
+    StringView popLine()
+    {
+        if (empty())
+        {
+            return StringView();
+        }
+        const char *end = (const char *)memchr(data, '\n', size);
+        size_t length = end ? end - data : size;
+        StringView line(data, length > 0 and data[length - 1] == '\r' ? length - 1 : length);
+        *this = substr(length + 1);
+        return line;
+    }
+};
 
 // Tetromino consists of 4 blocks
 class Block
@@ -17,22 +104,37 @@ public:
 class FxBlock
 {
 public:
+    static const int trailLength = 3;
     int x, y, colorId;
+    int trailX[trailLength], trailY[trailLength]; // earlier positions, newest first
     float startVelocity, startAngle;
     float vx0, vy0;
     float timer;
 
-    FxBlock(int x, int y, int colorId) : x(x), y(y), colorId(colorId)
+    FxBlock(int x, int y, int colorId, Random &random) : x(x), y(y), colorId(colorId)
     {
+        for (int i = 0; i < trailLength; i++)
+        {
+            trailX[i] = x;
+            trailY[i] = y;
+        }
         timer = 0;
-        startVelocity = rand() % 50 + 40;
-        startAngle = rand() % 180 + 1;
+        startVelocity = random.next(50) + 40;
+        startAngle = random.next(180) + 1;
         vx0 = startVelocity * cos(startAngle * (3.14159265 / 180));
         vy0 = startVelocity * sin(startAngle * (3.14159265 / 180));
     }
 
     void update(float elapsedTime)
     {
+        for (int i = trailLength - 1; i > 0; i--)
+        {
+            trailX[i] = trailX[i - 1];
+            trailY[i] = trailY[i - 1];
+        }
+        trailX[0] = x;
+        trailY[0] = y;
+
         timer += elapsedTime;
         float g = 9.81;
 
@@ -106,7 +208,7 @@ public:
     }
 };
 
-// Tetromino entity that stores the shape, current and previous position
+// Tetromino entity that stores the shape, current and previous position, rotated SRS-style inside its bounding box
 class Tetromino
 {
 public:
@@ -123,12 +225,16 @@ public:
 
     Block blocksCurrent[4];
     Block blocksPrevious[4];
+    Block spawnCells[4]; // blocks relative to the box in the spawn orientation
 
-    int rotationIndex;
+    int boxSize;     // 2 for O, 4 for I, 3 for the rest
+    int orientation; // 0 spawn, 1 right, 2 reversed, 3 left
     int shapeId;
     int colorId;
     int currentHardDropMaxDistance;
 
+    Tetromino() : boxSize(0), orientation(0), shapeId(0), colorId(0), currentHardDropMaxDistance(-1) {}
+
     void restorePreviousPosition()
     {
         for (int i = 0; i < 4; i++)
@@ -155,6 +261,15 @@ public:
         }
     }
 
+    void moveDown(int y)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            blocksPrevious[i] = blocksCurrent[i]; // backup
+            blocksCurrent[i].y += y;
+        }
+    }
+
     void moveUp(int y)
     {
         for (int i = 0; i < 4; i++)
@@ -163,84 +278,104 @@ public:
         }
     }
 
-    void rotate()
+    // Block i relative to the box after turning the spawn shape clockwise `turns` times
+    Block getCell(int i, int turns)
     {
-        if (rotationIndex >= 0)
+        Block cell = spawnCells[i];
+        for (int turn = 0; turn < (turns & 3); turn++)
         {
-            for (int i = 0; i < 4; i++)
-            {
-                blocksPrevious[i] = blocksCurrent[i]; // backup
-            }
-            Block p = blocksCurrent[rotationIndex];
-            for (int i = 0; i < 4; i++)
-            {
-                int x = blocksCurrent[i].y - p.y;
-                int y = blocksCurrent[i].x - p.x;
-                blocksCurrent[i].x = p.x - x;
-                blocksCurrent[i].y = p.y + y;
-            }
+            cell = Block(boxSize - 1 - cell.y, cell.x);
+        }
+        return cell;
+    }
+
+    Block getBox()
+    {
+        Block cell = getCell(0, orientation);
+        return Block(blocksCurrent[0].x - cell.x, blocksCurrent[0].y - cell.y);
+    }
+
+    // Turns in place within the box, direction 1 clockwise and -1 counterclockwise; kicks are up to Logic
+    void rotate(int direction = 1)
+    {
+        Block box = getBox();
+        orientation = (orientation + direction) & 3;
+        for (int i = 0; i < 4; i++)
+        {
+            blocksPrevious[i] = blocksCurrent[i]; // backup
+            Block cell = getCell(i, orientation);
+            blocksCurrent[i] = Block(box.x + cell.x, box.y + cell.y);
+        }
+    }
+
+    // Puts the piece in the given orientation with its box's top-left at box
+    void place(Block box, int newOrientation)
+    {
+        orientation = newOrientation & 3;
+        for (int i = 0; i < 4; i++)
+        {
+            Block cell = getCell(i, orientation);
+            blocksCurrent[i] = Block(box.x + cell.x, box.y + cell.y);
+            blocksPrevious[i] = blocksCurrent[i];
+        }
+    }
+
+    // One bit per occupied column for each box row, column 0 in bit 0
+    void getRowMasks(unsigned masks[4])
+    {
+        for (int r = 0; r < 4; r++)
+        {
+            masks[r] = 0;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            Block cell = getCell(i, orientation);
+            masks[cell.y] |= 1u << cell.x;
         }
     }
 };
 
-// Generates tetrominos with random shapes and colors
+// Builds tetrominos in their spawn orientation
 class Generator
 {
 public:
-    static Tetromino getTetromino(int lastColorId = -1)
-    {
-        int shape_1[4][2] = {
-            {1, 1},
-            {1, 1},
-            {0, 0},
-            {0, 0}};
-
-        int shape_2[4][2] = {
-            {1, 0},
-            {1, 2},
-            {0, 1},
-            {0, 0}};
-
-        int shape_3[4][2] = {
-            {0, 1},
-            {2, 1},
-            {1, 0},
-            {0, 0}};
-
-        int shape_4[4][2] = {
-            {1, 0},
-            {1, 0},
-            {2, 0},
-            {1, 0}};
-
-        int shape_5[4][2] = {
-            {1, 0},
-            {2, 0},
-            {1, 1},
-            {0, 0}};
-
-        int shape_6[4][2] = {
-            {0, 1},
-            {0, 2},
-            {1, 1},
-            {0, 0}};
-
-        int shape_7[4][2] = {
-            {1, 0},
-            {2, 1},
-            {1, 0},
-            {0, 0}};
+    static Tetromino getTetromino(int shapeId, int colorId)
+    {
+        // SRS spawn orientations, top rows of each box
+        int shape_1[2][4] = {
+            {1, 1, 0, 0},
+            {1, 1, 0, 0}};
+
+        int shape_2[2][4] = {
+            {0, 1, 1, 0},
+            {1, 1, 0, 0}};
+
+        int shape_3[2][4] = {
+            {1, 1, 0, 0},
+            {0, 1, 1, 0}};
+
+        int shape_4[2][4] = {
+            {0, 0, 0, 0},
+            {1, 1, 1, 1}};
+
+        int shape_5[2][4] = {
+            {0, 0, 1, 0},
+            {1, 1, 1, 0}};
+
+        int shape_6[2][4] = {
+            {1, 0, 0, 0},
+            {1, 1, 1, 0}};
+
+        int shape_7[2][4] = {
+            {0, 1, 0, 0},
+            {1, 1, 1, 0}};
 
         Tetromino tetromino;
-        tetromino.rotationIndex = -1;
-        tetromino.shapeId = (rand() % 7) + 1;
+        tetromino.orientation = 0;
+        tetromino.shapeId = shapeId;
+        tetromino.colorId = colorId;
         tetromino.currentHardDropMaxDistance = -1;
 
-        do
-        {
-            tetromino.colorId = (rand() % 7) + 9;
-        } while (tetromino.colorId == lastColorId);
-
         for (int i = 0; i < 4; i++)
         {
             tetromino.blocksPrevious[i].x = 0;
@@ -252,59 +387,51 @@ public:
         switch (tetromino.shapeId)
         {
         case Tetromino::Shape_O:
-            configureBlocks(tetromino, shape_1);
+            configureBlocks(tetromino, shape_1, 2);
             break;
 
         case Tetromino::Shape_S:
-            configureBlocks(tetromino, shape_2);
+            configureBlocks(tetromino, shape_2, 3);
             break;
 
         case Tetromino::Shape_Z:
-            configureBlocks(tetromino, shape_3);
+            configureBlocks(tetromino, shape_3, 3);
             break;
 
         case Tetromino::Shape_I:
-            configureBlocks(tetromino, shape_4);
+            configureBlocks(tetromino, shape_4, 4);
             break;
 
         case Tetromino::Shape_L:
-            configureBlocks(tetromino, shape_5);
+            configureBlocks(tetromino, shape_5, 3);
             break;
 
         case Tetromino::Shape_J:
-            configureBlocks(tetromino, shape_6);
+            configureBlocks(tetromino, shape_6, 3);
             break;
 
         case Tetromino::Shape_T:
-            configureBlocks(tetromino, shape_7);
+            configureBlocks(tetromino, shape_7, 3);
             break;
         }
 
         return tetromino;
     }
 
-    static void configureBlocks(Tetromino &tetromino, int shape[4][2])
+    static void configureBlocks(Tetromino &tetromino, int shape[2][4], int boxSize)
     {
         int blocksDoneNum = 0;
-        tetromino.rotationIndex = -1;
-        for (int i = 0; i < 4; i++)
+        tetromino.boxSize = boxSize;
+        for (int i = 0; i < 2; i++)
         {
-            for (int j = 0; j < 2; j++)
+            for (int j = 0; j < 4; j++)
             {
                 if (blocksDoneNum < 4 && shape[i][j] > 0)
                 {
-                    if (shape[i][j] == 2)
-                    {
-                        tetromino.rotationIndex = blocksDoneNum;
-                    }
-                    tetromino.blocksCurrent[blocksDoneNum].x = j;
-                    tetromino.blocksCurrent[blocksDoneNum].y = i;
+                    tetromino.spawnCells[blocksDoneNum] = Block(j, i);
+                    tetromino.blocksCurrent[blocksDoneNum] = Block(j, i);
                     blocksDoneNum++;
-                    if (blocksDoneNum == 4)
-                        break;
                 }
-                if (blocksDoneNum == 4)
-                    break;
             }
         }
     }
@@ -316,7 +443,12 @@ class Grid
 public:
     static const int rows = 20;
     static const int cols = 10;
+    static const int bufferRows = 4; // hidden rows -1..-bufferRows above the board, where pieces spawn
+    static const int wallBits = 4;   // columns of wall left of the board in a row mask
+    static const unsigned wallMask = ~(((1u << cols) - 1) << wallBits);
     int grid[rows][cols];
+    int buffer[bufferRows][cols];            // hidden row y lives in buffer[bufferRows + y]
+    unsigned rowMasks[bufferRows + rows]; // occupied cells and walls of row y at y + bufferRows, column x in bit x + wallBits
 
     Grid()
     {
@@ -325,1023 +457,6649 @@ public:
 
     void clear()
     {
-        for (int y = 0; y < rows; ++y)
+        for (int y = -bufferRows; y < rows; ++y)
         {
+            int *row = getRow(y);
             for (int x = 0; x < cols; ++x)
             {
-                grid[y][x] = 0;
+                row[x] = 0;
             }
+            rowMasks[y + bufferRows] = wallMask;
         }
     }
 
-    int getValue(int x, int y)
-    {
-        if (y < rows and x < cols)
-        {
-            return grid[y][x];
-        }
-        return -1;
-    }
-};
-
-// Identifies the user's intended action
-class Input
-{
-public:
-    int moveX;
-    bool rotate;
-    bool spacebar;
-    bool fastDrop;
-    bool paused;
-    bool shadowSwitch;
-
-    Input() : moveX(0),
-              rotate(0),
-              spacebar(0),
-              fastDrop(0),
-              paused(0),
-              shadowSwitch(0) {}
-};
-
-// Manages game states and holds current score
-class GameState
-{
-public:
-    int currentState;
-    int difficultyLevel;
-    int difficultyLevelStep;
-    int shadowEnabled;
-    Grid *grid;
-    Tetromino *tetromino;
-    Tetromino *nextTetromino;
-    const char *highscoreFilename;
-
-    GameState(Grid *gridPtr, Tetromino *tetrominoPtr, Tetromino *nextTetrominoPtr) : grid(gridPtr), tetromino(tetrominoPtr), nextTetromino(nextTetrominoPtr)
+    // Visible or hidden row, y from -bufferRows to rows - 1
+    int *getRow(int y)
     {
-        difficultyLevel = 1;
-        difficultyLevelStep = 5;
-        shadowEnabled = 1;
-        highscoreFilename = "score.txt";
+        return y < 0 ? buffer[bufferRows + y] : grid[y];
     }
 
-    enum StateId
-    {
-        Title,
-        Playing,
-        Pause,
-        GameOver
-    };
-
-    int currentScore;
-    int highestScore;
-
-    void loadHighScore()
+    void updateRowMask(int y)
     {
-        std::ifstream inputFile(highscoreFilename);
-        inputFile >> highestScore;
-        inputFile.close();
+        int *row = getRow(y);
+        unsigned mask = wallMask;
+        for (int x = 0; x < cols; ++x)
+        {
+            if (row[x])
+            {
+                mask |= 1u << (x + wallBits);
+            }
+        }
+        rowMasks[y + bufferRows] = mask;
     }
 
-    void saveHighScore()
+    unsigned getRowMask(int y)
     {
-        std::ofstream outputFile(highscoreFilename);
-        outputFile << highestScore;
-        outputFile.close();
+        if (y < -bufferRows)
+        {
+            return wallMask; // open sky above the buffer
+        }
+        if (y >= rows)
+        {
+            return ~0u; // floor
+        }
+        return rowMasks[y + bufferRows];
     }
 
-    void update(Input &input)
+    // Whether box row masks placed with the box's top-left at (x, y) hit a block, a wall or the floor
+    bool collides(const unsigned masks[4], int x, int y)
     {
-        switch (currentState)
+        int shift = x + wallBits;
+        for (int r = 0; r < 4; r++)
         {
-        case Title:
-
-            if (input.spacebar)
-            {
-                loadHighScore();
-                currentState = Playing;
-                input.spacebar = 0;
-                generateNewTetromino();
-            }
-
-            break;
-
-        case Playing:
-
-            if (currentScore > highestScore)
+            if (masks[r] == 0)
             {
-                highestScore = currentScore;
-                saveHighScore(); // TODO render congratulations
-            }
-
-            if (input.paused)
-            {
-                currentState = Pause;
-                input.paused = 0;
+                continue;
             }
-
-            if (input.shadowSwitch)
+            if (shift < 0 or shift > 28)
             {
-                shadowEnabled *= -1;
-                input.shadowSwitch = 0;
+                return 1;
             }
-
-            if (currentScore >= difficultyLevelStep)
+            if (getRowMask(y + r) & (masks[r] << shift))
             {
-                difficultyLevel++;
-                difficultyLevelStep += 5;
+                return 1;
             }
+        }
+        return 0;
+    }
 
-            break;
-
-        case Pause:
-
-            if (input.paused)
+    // Bit x + wallBits set for every box column x where box row masks fit with the box's top at row
+    // y, found for all columns at once: a cell in box column c rules out the shifts putting it on a set bit
+    unsigned getFreeShifts(const unsigned masks[4], int y)
+    {
+        unsigned blocked = 0;
+        for (int r = 0; r < 4; r++)
+        {
+            unsigned row = getRowMask(y + r);
+            for (unsigned cells = masks[r]; cells; cells &= cells - 1)
             {
-                currentState = Playing;
-                input.paused = 0;
+                blocked |= row >> __builtin_ctz(cells);
             }
+        }
+        return ~blocked & ((1u << (wallBits + cols)) - 1);
+    }
 
-            break;
-
-        case GameOver:
-
-            if (input.spacebar)
+    bool isEmpty()
+    {
+        for (int i = 0; i < bufferRows + rows; i++)
+        {
+            if (rowMasks[i] != wallMask)
             {
-                grid->clear();
-                currentState = Playing;
-                input.spacebar = 0;
-                currentScore = 0;
-                difficultyLevel = 1;
-                difficultyLevelStep = 5;
-                generateNewTetromino();
-                loadHighScore();
+                return 0;
             }
-
-            break;
-
-        default:
-            break;
         }
+        return 1;
     }
 
-    void generateNewTetromino() // TODO fix duplicated Logic
+    bool isInside(int x, int y)
     {
-        int lastColorId = tetromino->colorId;
-        *tetromino = *nextTetromino;
+        return y >= -bufferRows and y < rows and x >= 0 and x < cols;
+    }
 
-        switch (tetromino->shapeId)
+    int getValue(int x, int y)
+    {
+        if (isInside(x, y))
         {
-        case Tetromino::Shape_I:
-            tetromino->moveUp(4);
-            break;
-        case Tetromino::Shape_O:
-            tetromino->moveUp(2);
-            break;
-        default:
-            tetromino->moveUp(3);
-            break;
+            return getRow(y)[x];
         }
-        tetromino->moveX((rand() % (grid->cols - 2)) + 1);
-        *nextTetromino = Generator::getTetromino(lastColorId);
+        return -1;
     }
 };
 
-// Flying blocks container
-class SpecialEffects
+// Upcoming pieces as packed ids (color << 3 | shape), refilled one shuffled 7-piece bag at a time
+class PieceQueue
 {
 public:
-    std::vector<FxBlock *> fxBlocks;
+    static const int capacity = 16; // power of two, room for a whole bag on top of the longest preview
+    static const int maxPreview = 6;
 
-    SpecialEffects()
-    {
-        fxBlocks.resize(Grid::rows * Grid::cols, NULL);
-    }
+    unsigned char pieces[capacity];
+    unsigned head; // pieces taken so far
+    unsigned tail; // pieces added so far
+    int lastColorId;
+    Random *random;
+    StringView script; // shape letters dealt before any bag, e.g. a puzzle's queue inside its pack
+
+    PieceQueue(Random *randomPtr = NULL) : head(0), tail(0), lastColorId(-1), random(randomPtr) {}
 
-    void removeBlock(FxBlock *block)
+    // Shape id of a letter of "OSZILJT", 0 for anything else
+    static int fromLetter(char letter)
     {
-        for (std::vector<FxBlock *>::iterator it = fxBlocks.begin(); it != fxBlocks.end(); ++it)
+        const char *letters = "OSZILJT";
+        for (int i = 0; i < 7; i++)
         {
-            if (*it == block)
+            if (letters[i] == letter)
             {
-                delete *it;
-                fxBlocks.erase(it);
-                break;
+                return i + 1;
             }
         }
+        return 0;
     }
 
-    void createFxBlock(int x, int y, int c)
+    static unsigned char pack(int shapeId, int colorId)
     {
-        FxBlock *newBlock = new FxBlock(x * 32, y * 32, c);
-        fxBlocks.push_back(newBlock);
+        return colorId << 3 | shapeId;
     }
 
-    void removeFxBlocks()
+    static int getShapeId(unsigned char piece)
+    {
+        return piece & 7;
+    }
+
+    static int getColorId(unsigned char piece)
+    {
+        return piece >> 3;
+    }
+
+    void reset()
+    {
+        head = tail = 0;
+        lastColorId = -1;
+        fill();
+    }
+
+    void fill()
     {
-        for (std::vector<FxBlock *>::iterator it = fxBlocks.begin(); it != fxBlocks.end(); ++it)
+        while (tail - head <= (unsigned)maxPreview)
         {
-            if (*it and ((*it)->y > (Grid::rows * 32) or (*it)->x < 0 || (*it)->x > (Grid::cols * 32)))
+            if (!addScripted())
             {
-                removeBlock((*it));
-                break;
+                addBag();
             }
         }
     }
 
-    void updateFxBlocks()
+    // Deals the script's next shape, skipping anything that is not a shape letter; false once it ran out
+    bool addScripted()
     {
-        for (std::vector<FxBlock *>::iterator it = fxBlocks.begin(); it != fxBlocks.end(); ++it)
+        while (!script.empty())
         {
-            if (*it)
+            int shapeId = fromLetter(script.front());
+            script = script.substr(1);
+            if (shapeId)
             {
-                (*it)->update(0.01);
+                pieces[tail++ & (capacity - 1)] = pack(shapeId, getColorId());
+                return 1;
             }
         }
+        return 0;
     }
-};
-
-// Rendering functions
-class View
-{
-public:
-    static const int tileSize = 32;
-    sf::Font font;
-    sf::RenderWindow *window;
-    Grid *grid;
-    Tetromino *tetromino;
-    Tetromino *nextTetromino;
-    GameState *state;
-    SpecialEffects *specialEffects;
 
-    View(sf::RenderWindow *windowPtr, Grid *gridPtr, Tetromino *tetrominoPtr, Tetromino *nextTetrominoPtr, GameState *statePtr, SpecialEffects *specialEffectsPtr)
-        : window(windowPtr), grid(gridPtr), tetromino(tetrominoPtr), nextTetromino(nextTetrominoPtr), state(statePtr), specialEffects(specialEffectsPtr)
+    void addBag()
     {
-        font.loadFromFile("retro.ttf");
+        int bag[7] = {1, 2, 3, 4, 5, 6, 7};
+        for (int i = 6; i > 0; i--)
+        {
+            std::swap(bag[i], bag[random->next(i + 1)]);
+        }
+        for (int i = 0; i < 7; i++)
+        {
+            pieces[tail++ & (capacity - 1)] = pack(bag[i], getColorId());
+        }
     }
 
-    static int getWindowWidth()
+    // A random piece color, never the previous one
+    int getColorId()
     {
-        return tileSize * Grid::cols + 1 + (tileSize * 6);
+        int colorId;
+        do
+        {
+            colorId = random->next(7) + 9;
+        } while (colorId == lastColorId);
+        lastColorId = colorId;
+        return colorId;
     }
 
-    static int getWindowHeight()
+    // The i-th upcoming piece, 0 being the next one; valid up to maxPreview
+    unsigned char peek(int i)
     {
-        return tileSize * Grid::rows + 1;
+        return pieces[(head + i) & (capacity - 1)];
     }
 
-    void renderGameOver()
+    unsigned char pop()
     {
-        sf::Text text;
-        text.setFont(font);
-        text.setString("Game Over");
-        text.setCharacterSize(28);
-        text.setPosition(65, 250);
-        window->draw(text);
+        unsigned char piece = pieces[head++ & (capacity - 1)];
+        fill();
+        return piece;
     }
+};
 
-    void renderPause()
+// Lock-free single-producer single-consumer queue, capacity must be a power of two
+template <typename T, int capacity>
+class RingBuffer
+{
+public:
+    T items[capacity];
+    std::atomic<unsigned> head; // next slot to read, written by the consumer only
+    std::atomic<unsigned> tail; // next slot to write, written by the producer only
+
+    RingBuffer() : head(0), tail(0) {}
+
+    bool push(const T &item)
     {
-        sf::Text text;
-        text.setFont(font);
-        text.setString("Paused");
-        text.setCharacterSize(32);
-        text.setPosition(90, 250);
-        window->draw(text);
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= (unsigned)capacity)
+        {
+            return 0; // full
+        }
+        items[t & (capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return 1;
     }
 
-    void renderTitleScreen()
+    bool peek(T &item)
     {
-        sf::Text text;
-        text.setFont(font);
-        text.setString("Tetris");
-        text.setCharacterSize(55);
-        text.setPosition(135, 250);
-        window->draw(text);
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+        {
+            return 0; // empty
+        }
+        item = items[h & (capacity - 1)];
+        return 1;
     }
 
-    void renderTetromino()
+    bool pop(T &item)
     {
-        sf::RectangleShape tile;
-        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
-        tile.setFillColor(Colors::getColor(tetromino->colorId));
-        for (int i = 0; i < 4; i++)
+        if (!peek(item))
         {
-            tile.setPosition(tetromino->blocksCurrent[i].x * tileSize, tetromino->blocksCurrent[i].y * tileSize);
-            tile.move(1, 1);
-            window->draw(tile);
+            return 0;
         }
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        return 1;
     }
+};
+
+// Lock-free hand-off of the latest value from one producer to one consumer: the producer fills its
+// back slot and swaps it into the middle, the consumer swaps the middle out when it is newer, so
+// neither ever waits and the consumer's slot stays untouched until it asks for another
+template <typename T>
+class TripleBuffer
+{
+public:
+    static const int fresh = 4; // set in middle while it holds a slot the consumer has not taken
+
+    T slots[3];
+    std::atomic<int> middle; // slot index, plus fresh
+    int back;                // slot the producer writes, producer only
+    int front;               // slot the consumer reads, consumer only
+
+    TripleBuffer() : middle(1), back(0), front(2) {}
 
-    void renderFlyingBlocks()
+    T *getBack()
     {
-        sf::RectangleShape tile;
-        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
-        for (std::vector<FxBlock *>::iterator it = specialEffects->fxBlocks.begin(); it != specialEffects->fxBlocks.end(); ++it)
+        return &slots[back];
+    }
+
+    void publish()
+    {
+        back = middle.exchange(back | fresh, std::memory_order_acq_rel) & 3;
+    }
+
+    // The newest published value, or the one returned last time when nothing new was published
+    T *acquire()
+    {
+        if (middle.load(std::memory_order_relaxed) & fresh)
         {
-            if (*it)
-            {
-                tile.setFillColor(Colors::getColor((*it)->colorId, 200));
-                tile.setPosition((*it)->x, (*it)->y);
-                window->draw(tile);
-            }
+            front = middle.exchange(front, std::memory_order_acq_rel) & 3;
         }
+        return &slots[front];
     }
+};
 
-    void renderNextTetromino()
+// Single user action stamped with the time it was captured (microseconds)
+class InputEvent
+{
+public:
+    enum Type
     {
-        sf::Text text;
-        text.setFont(font);
-        text.setString("next");
-        text.setCharacterSize(22);
-        text.setPosition((12 * tileSize), 32);
-        window->draw(text);
+        MoveLeft,
+        MoveLeftReleased,
+        MoveRight,
+        MoveRightReleased,
+        Rotate,
+        HardDrop,
+        SoftDropPressed,
+        SoftDropReleased,
+        Pause,
+        ShadowSwitch,
+        RotateCounterClockwise,
+        Hold,
+        NextPuzzle,
+        RestartPuzzle
+    };
 
-        sf::RectangleShape tile;
-        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
-        tile.setFillColor(Colors::getColor(nextTetromino->colorId));
-        for (int i = 0; i < 4; i++)
+    int type;
+    sf::Int64 time;
+
+    InputEvent() : type(0), time(0) {}
+    InputEvent(int type, sf::Int64 time) : type(type), time(time) {}
+};
+
+// Identifies the user's intended actions in the order they happened
+class Input
+{
+public:
+    static const int capacity = 256;
+    RingBuffer<InputEvent, capacity> events;
+    int droppedEvents;
+
+    Input() : droppedEvents(0) {}
+
+    void push(int type, sf::Int64 time)
+    {
+        if (!events.push(InputEvent(type, time)))
         {
-            tile.setPosition(nextTetromino->blocksCurrent[i].x * tileSize + (12 * tileSize), nextTetromino->blocksCurrent[i].y * tileSize + (3 * tileSize));
-            tile.move(1, 1);
-            window->draw(tile);
+            droppedEvents++;
         }
     }
+};
 
-    void renderCurrentTetrominoShadow()
+// Seed, settings and tick-stamped input events of a session, enough to reproduce it exactly
+class Replay
+{
+public:
+    struct Event
     {
-        sf::RectangleShape tile;
-        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
-        tile.setFillColor(Colors::getColor(Colors::Grey, 80));
+        sf::Int64 tick;
+        int type;
+    };
 
-        bool show = true;
+    unsigned seed;
+    int dasMicroseconds; // -1 in replays recorded before settings were
+    int arrMicroseconds;
+    std::string rules;   // as Rules::write puts them, empty when not recorded
+    std::vector<Event> events;
 
-        if (state->shadowEnabled != 1)
+    Replay(unsigned seed = 1) : seed(seed), dasMicroseconds(-1), arrMicroseconds(-1) {}
+
+    void add(sf::Int64 tick, int type)
+    {
+        Event event;
+        event.tick = tick;
+        event.type = type;
+        events.push_back(event);
+    }
+
+    bool save(const char *filename)
+    {
+        std::ofstream outputFile(filename);
+        outputFile << "seed " << seed << "\n";
+        if (dasMicroseconds >= 0)
         {
-            show = false;
+            outputFile << "das_us " << dasMicroseconds << "\narr_us " << arrMicroseconds << "\n";
         }
-        else
+        std::istringstream lines(rules);
+        std::string line;
+        while (std::getline(lines, line))
         {
-            for (int i = 0; i < 4; i++)
-            {
-                if (tetromino->blocksCurrent[i].y < 0)
-                {
-                    show = false;
-                    break;
-                }
-            }
+            outputFile << "rule " << line << "\n";
+        }
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            outputFile << events[i].tick << " " << events[i].type << "\n";
         }
+        return outputFile.good();
+    }
 
-        if (show and tetromino->currentHardDropMaxDistance > 0)
+    bool load(const char *filename)
+    {
+        std::ifstream inputFile(filename);
+        std::string header;
+        if (!(inputFile >> header >> seed) or header != "seed")
         {
-            for (int i = 0; i < 4; i++)
+            return 0;
+        }
+        events.clear();
+        rules.clear();
+        dasMicroseconds = arrMicroseconds = -1;
+
+        // Settings lines, then events
+        std::string line;
+        while (std::getline(inputFile, line))
+        {
+            std::istringstream fields(line);
+            std::string key;
+            Event event;
+            if (!(fields >> key))
+            {
+                continue;
+            }
+            if (key == "das_us")
+            {
+                fields >> dasMicroseconds;
+            }
+            else if (key == "arr_us")
+            {
+                fields >> arrMicroseconds;
+            }
+            else if (key == "rule")
+            {
+                rules += line.substr(5) + "\n";
+            }
+            else if (std::istringstream(line) >> event.tick >> event.type)
+            {
+                events.push_back(event);
+            }
+            else
             {
-                tile.setPosition(tetromino->blocksCurrent[i].x * tileSize, tetromino->blocksCurrent[i].y * tileSize);
-                tile.move(1, tetromino->currentHardDropMaxDistance * tileSize + 1);
-                window->draw(tile);
+                break;
             }
         }
+        return 1;
     }
+};
 
-    void renderScore()
+// Something that happened in the game, published by Logic and GameState
+class GameEvent
+{
+public:
+    enum Type
     {
-        sf::Text text;
-        text.setFont(font);
-
-        text.setString("score");
-        text.setCharacterSize(22);
-        text.setPosition(tileSize * 11 + 24, tileSize * 8 + 12);
-        window->draw(text);
-
-        text.setString(std::to_string(state->currentScore));
-        text.setCharacterSize(28);
-        text.setPosition(tileSize * 11 + 24, tileSize * 9 + 5);
-        window->draw(text);
-
-        text.setString("high");
-        text.setCharacterSize(22);
-        text.setPosition(tileSize * 11 + 24, tileSize * 10 + 12);
-        window->draw(text);
+        GameStarted,
+        PieceSpawned,
+        PieceRotated,
+        PieceLocked,  // value: lines cleared by the lock, inputs / minimumInputs: keys used on the piece
+        RowCleared,   // value: row, colors: cells before clearing
+        LinesCleared, // value: number of lines
+        LevelUp,      // value: new level
+        GameEnded,
+        SplitReached, // value: splits so far
+        ScoreChanged  // value: points added
+    };
 
-        text.setString(std::to_string(state->highestScore));
-        text.setCharacterSize(28);
-        text.setPosition(tileSize * 11 + 24, tileSize * 11 + 5);
-        window->draw(text);
+    int type;
+    int value;
+    sf::Int64 tick;
+    int inputs;
+    int minimumInputs;
+    sf::Uint8 colors[Grid::cols];
+};
 
-        text.setString("level");
-        text.setCharacterSize(20);
-        text.setPosition(tileSize * 11 + 24, tileSize * 13);
-        window->draw(text);
+// Receives the events of one tick as a batch
+class EventListener
+{
+public:
+    virtual ~EventListener() {}
+    virtual void onEvents(const GameEvent *events, int count) = 0;
+};
 
-        text.setString(std::to_string(state->difficultyLevel));
-        text.setCharacterSize(20);
-        text.setPosition(tileSize * 11 + 24, tileSize * 14);
-        window->draw(text);
+// Fixed-capacity per-tick event buffer, delivered to every listener at the end of the tick
+class EventBus
+{
+public:
+    static const int capacity = 64;
+    static const int maxListeners = 8;
+    GameEvent events[capacity];
+    GameEvent overflow; // written instead of events when they are full, then ignored
+    int count;
+    int droppedEvents;
+    EventListener *listeners[maxListeners];
+    int listenerCount;
+    sf::Int64 tick; // stamped on every published event
+
+    EventBus() : count(0), droppedEvents(0), listenerCount(0), tick(0) {}
+
+    void subscribe(EventListener *listener)
+    {
+        if (listenerCount < maxListeners)
+        {
+            listeners[listenerCount++] = listener;
+        }
     }
 
-    void renderGrid()
+    void unsubscribe(EventListener *listener)
     {
-        sf::RectangleShape tile;
-        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
-        tile.setFillColor(Colors::getColor(Colors::Black));
-
-        sf::RectangleShape background;
-        background.setSize(sf::Vector2f(grid->cols * tileSize + 1, grid->rows * tileSize + 1));
-        background.setFillColor(Colors::getColor(Colors::Blue));
-        window->draw(background);
-
-        int value;
-
-        for (int i = 0; i < grid->rows; i++)
+        for (int i = 0; i < listenerCount; i++)
         {
-            for (int j = 0; j < grid->cols; j++)
+            if (listeners[i] == listener)
             {
-                value = grid->getValue(j, i);
-
-                if (value > 0)
-                {
-                    tile.setFillColor(Colors::getColor(value));
-                }
-                else
-                {
-                    tile.setFillColor(Colors::getColor(Colors::Black));
-                }
-
-                tile.setPosition(j * tileSize + 1, i * tileSize + 1);
-                window->draw(tile);
+                listeners[i] = listeners[--listenerCount];
+                break;
             }
         }
     }
 
-    void renderHelp()
+    // Returns the slot to fill in; when full the event goes to a scratch slot and is counted as dropped
+    GameEvent &publish(int type, int value = 0)
     {
-        int offsetY = 500;
-        int offsetX = 345;
-        sf::Text text;
-        text.setFont(font);
-        text.setCharacterSize(13);
-        text.setString("up       - rotate");
-        text.setPosition(offsetX, offsetY);
-        window->draw(text);
-        offsetY += 22;
-        text.setString("down   - soft drop");
-        text.setPosition(offsetX, offsetY);
-        window->draw(text);
-        offsetY += 22;
-        text.setString("space - hard drop");
-        text.setPosition(offsetX, offsetY);
-        window->draw(text);
-        offsetY += 32;
-        text.setString("p - pause");
-        text.setPosition(offsetX, offsetY);
-        window->draw(text);
-        offsetY += 22;
-        text.setString("q - quit");
-        text.setPosition(offsetX, offsetY);
-        window->draw(text);
+        GameEvent &event = count < capacity ? events[count++] : overflow;
+        if (&event == &overflow)
+        {
+            droppedEvents++;
+        }
+        event.type = type;
+        event.value = value;
+        event.tick = tick;
+        return event;
     }
 
-    void render()
+    void dispatch()
     {
-        window->clear(sf::Color::Black);
-
-        if (state->currentState == GameState::Title)
+        if (count == 0)
         {
-            renderTitleScreen();
+            return;
         }
-        else
+        for (int i = 0; i < listenerCount; i++)
         {
-            renderGrid();
-            renderNextTetromino();
-            renderScore();
-            renderTetromino();
-            renderCurrentTetrominoShadow();
-            renderHelp();
-            renderFlyingBlocks();
-
-            if (state->currentState == GameState::Pause)
-            {
-                renderPause();
-            }
-            else if (state->currentState == GameState::GameOver)
-            {
-                renderGameOver();
-            }
+            listeners[i]->onEvents(events, count);
         }
-
-        window->display();
+        count = 0;
     }
 };
 
-// Game logic goes here
-class Logic
+// Scoring, level and gravity tables, loaded once and indexed by level at run time
+class Rules
 {
 public:
-    Grid *grid;
-    Input *input;
-    Tetromino *tetromino;
-    GameState *state;
-    Tetromino *nextTetromino;
-    SpecialEffects *specialEffects;
+    static const int maxLevel = 20;
+    static const int gravityOne = 65536; // fixed point: one cell
 
-    float dropTimer;
-    float dropDelay;
-    float scoreTimer;
+    // Where a new piece's box goes; with no column it fits in the game is over
+    enum SpawnPolicy
+    {
+        SpawnRandom,    // any column it fits in, uniformly
+        SpawnCenter,    // the fitting column nearest the center
+        SpawnGuideline, // the center only, left of it for odd widths
+    };
 
-    Logic(Grid *gridPtr, Input *inputPtr, Tetromino *tetrominoPtr, GameState *statePtr, Tetromino *nextTetrominoPtr, SpecialEffects *specialEffectsPtr) : grid(gridPtr), input(inputPtr), tetromino(tetrominoPtr), state(statePtr), nextTetromino(nextTetrominoPtr), specialEffects(specialEffectsPtr)
+    // When a game ends besides block out
+    enum Mode
     {
-        dropTimer = 0;
-        dropDelay = 1;
-        scoreTimer = 0;
-    }
+        Marathon, // never
+        Sprint,   // once sprintLines are cleared
+        Ultra,    // once ultraMicroseconds of play have passed
+    };
 
-    void update(float time)
+    int lineClearPoints[5]; // times level, by lines cleared at once
+    int comboPoints;        // times combo count and level
+    int softDropPoints;     // per cell
+    int hardDropPoints;     // per cell
+    int linesPerLevel;
+    int softDropFactor;
+    int minSoftDropRowMicroseconds;
+    int lockDelayMicroseconds; // time a grounded piece waits before locking
+    int maxLockResets;         // moves and rotations that restart the lock delay, per row reached
+    int spawnPolicy;
+    int mode;
+    int sprintLines;
+    sf::Int64 ultraMicroseconds;
+    int rowMicroseconds[maxLevel + 1]; // time to fall one row, by level
+
+    // Derived by prepare()
+    int linesForLevel[maxLevel + 2];
+    int gravity[maxLevel + 1];     // cells per logic tick in 1/gravityOne
+    int softGravity[maxLevel + 1];
+    int tickMicroseconds;
+    sf::Int64 ultraTicks;
+
+    Rules()
     {
-        if (state->currentState == GameState::Playing)
+        const int points[5] = {0, 100, 300, 500, 800};
+        // Guideline curve (0.8 - (level - 1) * 0.007) ^ (level - 1) s, reaching 20G (1/1200 s) at level 20
+        const int rows[maxLevel + 1] = {1000000, 1000000, 793000, 617796, 472729, 355200, 262000, 189677, 134740, 93940, 64248,
+                                        43127, 28411, 18365, 11648, 7250, 4414, 2629, 1533, 1000, 833};
+        for (int i = 0; i < 5; i++)
         {
-            // MOVE LEFT OR RIGHT
-            if (input->moveX != 0)
-            {
-                tetromino->moveX(input->moveX);
+            lineClearPoints[i] = points[i];
+        }
+        for (int i = 0; i <= maxLevel; i++)
+        {
+            rowMicroseconds[i] = rows[i];
+        }
+        comboPoints = 50;
+        softDropPoints = 1;
+        hardDropPoints = 2;
+        linesPerLevel = 10;
+        softDropFactor = 20;
+        minSoftDropRowMicroseconds = 20000;
+        lockDelayMicroseconds = 500000;
+        maxLockResets = 15;
+        spawnPolicy = SpawnRandom;
+        mode = Marathon;
+        sprintLines = 40;
+        ultraMicroseconds = 120000000;
+        prepare();
+    }
 
-                input->moveX = 0;
+    // Reads "key value..." lines overriding the defaults, e.g. "line_clear 0 40 100 300 1200"
+    bool load(const char *filename)
+    {
+        std::ifstream inputFile(filename);
+        return inputFile and read(inputFile);
+    }
 
-                if (!isCurrentPositionValid())
+    bool read(std::istream &inputFile)
+    {
+        std::string key;
+        while (inputFile >> key)
+        {
+            if (key == "line_clear")
+            {
+                for (int i = 0; i < 5; i++)
                 {
-                    tetromino->restorePreviousPosition();
+                    inputFile >> lineClearPoints[i];
                 }
-
-                tetromino->currentHardDropMaxDistance = getHardDropOffsetY();
             }
-
-            // ROTATE
-            if (input->rotate)
+            else if (key == "row_time_us")
             {
-                tetromino->rotate();
-
-                input->rotate = 0;
-
-                int wallKickDistanceX = getWallKickDistanceX();
-                if (wallKickDistanceX != 0)
-                {
-                    tetromino->moveX(wallKickDistanceX);
-                }
-
-                if (!isCurrentPositionValid())
+                for (int i = 1; i <= maxLevel; i++)
                 {
-                    tetromino->restorePreviousPosition();
+                    inputFile >> rowMicroseconds[i];
                 }
-
-                tetromino->currentHardDropMaxDistance = getHardDropOffsetY();
             }
-
-            // HARD DROP
-            if (input->spacebar)
+            else if (key == "combo")
             {
-                doHardDrop();
-
-                input->spacebar = 0;
-
-                if (!isPositionAfterNextDropValid())
-                {
-                    if (isAtTopRow())
-                    {
-                        state->currentState = GameState::GameOver;
-                        return; // break the update
-                    }
-                    else
-                    {
-                        placeTetrominoHere();
-                        state->currentScore += clearFullRows();
-                        generateNewTetromino();
-                    }
-                }
-
-                tetromino->currentHardDropMaxDistance = getHardDropOffsetY();
+                inputFile >> comboPoints;
             }
-
-            // FREE DROP AND SOFT DROP
-            if (state->difficultyLevel == 2)
+            else if (key == "soft_drop")
             {
-                dropDelay = 0.8;
+                inputFile >> softDropPoints;
             }
-            else if (state->difficultyLevel == 3)
+            else if (key == "hard_drop")
             {
-                dropDelay = 0.6;
+                inputFile >> hardDropPoints;
             }
-            else if (state->difficultyLevel == 4)
+            else if (key == "lines_per_level")
             {
-                dropDelay = 0.4;
+                inputFile >> linesPerLevel;
             }
-            else if (state->difficultyLevel >= 5)
+            else if (key == "soft_drop_factor")
             {
-                dropDelay = 0.2;
+                inputFile >> softDropFactor;
             }
-            else
+            else if (key == "lock_delay_us")
             {
-                dropDelay = 1;
+                inputFile >> lockDelayMicroseconds;
             }
-
-            dropTimer += time;
-
-            float dropTimerDelay = dropDelay;
-
-            if (input->fastDrop)
+            else if (key == "lock_resets")
             {
-                dropTimerDelay = 0.02;
+                inputFile >> maxLockResets;
             }
-
-            if (dropTimer > dropTimerDelay)
+            else if (key == "spawn")
             {
-                tetromino->dropDown();
-                dropTimer = 0;
-
-                if (!isCurrentPositionValid())
-                {
-                    tetromino->restorePreviousPosition();
-                }
-
-                if (!isPositionAfterNextDropValid())
-                {
-                    if (isAtTopRow())
-                    {
-                        state->currentState = GameState::GameOver;
-                        return; // break the update loop
-                    }
-                    else
-                    {
-                        placeTetrominoHere();
-                        state->currentScore += clearFullRows();
-                        generateNewTetromino();
-                    }
-                }
-
-                tetromino->currentHardDropMaxDistance = getHardDropOffsetY();
+                std::string policy;
+                inputFile >> policy;
+                spawnPolicy = getSpawnPolicy(policy.c_str());
             }
-
-            // SPECIAL EFFECTS
-            scoreTimer += time;
-            if (scoreTimer > 0.01)
+            else if (key == "mode")
             {
-                specialEffects->updateFxBlocks();
-                scoreTimer = 0;
+                std::string name;
+                inputFile >> name;
+                mode = getMode(name.c_str());
+            }
+            else if (key == "sprint_lines")
+            {
+                inputFile >> sprintLines;
+            }
+            else if (key == "ultra_time_us")
+            {
+                inputFile >> ultraMicroseconds;
+            }
+            else
+            {
+                return 0;
+            }
+            if (inputFile.fail())
+            {
+                return 0; // a malformed value, or a table cut short by the next key or the end
             }
-
-            specialEffects->removeFxBlocks();
         }
+
+        prepare();
+        return inputFile.eof() and !inputFile.bad();
     }
 
-    void doHardDrop()
+    // Every setting as lines read() takes back, so a replay can carry the rules it was played with
+    void write(std::ostream &outputFile)
     {
-        int dropOffset = 0;
-        dropOffset = getHardDropOffsetY();
-
-        if (dropOffset)
+        const char *spawnNames[] = {"random", "center", "guideline"};
+        const char *modeNames[] = {"marathon", "sprint", "ultra"};
+        outputFile << "line_clear";
+        for (int i = 0; i < 5; i++)
         {
-            for (int j = 1; j <= dropOffset + 1; j++)
-            {
-                for (int i = 0; i < 4; i++)
-                {
-                    tetromino->blocksPrevious[i] = tetromino->blocksCurrent[i];
-                    tetromino->blocksCurrent[i].y = tetromino->blocksCurrent[i].y + 1;
-                }
-
-                if (!isCurrentPositionValid())
-                {
-                    tetromino->restorePreviousPosition();
-                }
-            }
+            outputFile << " " << lineClearPoints[i];
+        }
+        outputFile << "\nrow_time_us";
+        for (int i = 1; i <= maxLevel; i++)
+        {
+            outputFile << " " << rowMicroseconds[i];
         }
+        outputFile << "\ncombo " << comboPoints << "\nsoft_drop " << softDropPoints << "\nhard_drop " << hardDropPoints << "\nlines_per_level " << linesPerLevel
+                   << "\nsoft_drop_factor " << softDropFactor << "\nlock_delay_us " << lockDelayMicroseconds << "\nlock_resets " << maxLockResets
+                   << "\nspawn " << spawnNames[spawnPolicy] << "\nmode " << modeNames[mode] << "\nsprint_lines " << sprintLines
+                   << "\nultra_time_us " << ultraMicroseconds << "\n";
     }
 
-    bool isTetrominoInViewPort()
+    static int getSpawnPolicy(const char *name)
     {
-        for (int i = 0; i < 4; i++)
+        return strcmp(name, "center") == 0 ? SpawnCenter : strcmp(name, "guideline") == 0 ? SpawnGuideline : SpawnRandom;
+    }
+
+    static int getMode(const char *name)
+    {
+        return strcmp(name, "sprint") == 0 ? Sprint : strcmp(name, "ultra") == 0 ? Ultra : Marathon;
+    }
+
+    // Box column for a new piece of this box size, from a mask with bit x set for every box column x it
+    // fits in; -1 when the policy finds none. Random draws once from the fitting columns, so with an open
+    // spawn area it takes the same draw as a plain random column
+    static int chooseSpawnColumn(unsigned fits, int boxSize, int policy, Random &random)
+    {
+        int center = (Grid::cols - boxSize) / 2;
+        if (policy == SpawnGuideline)
         {
-            if (tetromino->blocksCurrent[i].y < 0)
+            return fits >> center & 1 ? center : -1;
+        }
+        if (!fits)
+        {
+            return -1;
+        }
+        if (policy == SpawnCenter)
+        {
+            unsigned right = fits >> center << center;
+            unsigned left = fits & ((1u << center) - 1);
+            if (!right or (left and center - (31 - __builtin_clz(left)) <= __builtin_ctz(right) - center))
             {
-                return 0;
+                return 31 - __builtin_clz(left);
             }
+            return __builtin_ctz(right);
         }
-        return 1;
+        for (int skip = random.next(__builtin_popcount(fits)); skip > 0; skip--)
+        {
+            fits &= fits - 1;
+        }
+        return __builtin_ctz(fits);
     }
 
-    int getLowestYoffset()
+    void prepare(int tickMicroseconds = 1000)
     {
-        int lowestY = -10;
-        for (int i = 0; i < 4; i++)
+        this->tickMicroseconds = tickMicroseconds;
+        ultraTicks = std::max(ultraMicroseconds / tickMicroseconds, (sf::Int64)1);
+        sprintLines = std::max(sprintLines, 1);
+        linesPerLevel = std::max(linesPerLevel, 1);
+        for (int level = 0; level <= maxLevel + 1; level++)
         {
-            if (tetromino->blocksCurrent[i].y > lowestY)
-            {
-                lowestY = tetromino->blocksCurrent[i].y;
-            }
+            linesForLevel[level] = std::max(level - 1, 0) * linesPerLevel;
+        }
+        for (int level = 0; level <= maxLevel; level++)
+        {
+            int row = std::max(rowMicroseconds[level], 1);
+            int softRow = std::max(std::min(row / std::max(softDropFactor, 1), minSoftDropRowMicroseconds), 1);
+            gravity[level] = (sf::Int64)gravityOne * tickMicroseconds / row;
+            softGravity[level] = (sf::Int64)gravityOne * tickMicroseconds / softRow;
         }
-        return lowestY;
     }
 
-    int getOffsetBlockedByGrid(int dropDist)
+    int getGravity(int level, bool softDrop)
     {
-        int offsetY = 0;
-        int maxOffset = 0;
+        level = std::min(level, (int)maxLevel);
+        return softDrop ? softGravity[level] : gravity[level];
+    }
 
-        while (offsetY < dropDist)
-        {
-            offsetY++;
-            for (int i = 0; i < 4; i++)
-            {
-                if (maxOffset == 0 and tetromino->blocksCurrent[i].y + offsetY >= (grid->rows - 1))
-                {
-                    if (offsetY > maxOffset)
-                    {
-                        maxOffset = offsetY;
-                    }
-                }
-            }
-        }
+    int getLineClearPoints(int lines, int level)
+    {
+        return lineClearPoints[std::min(lines, 4)] * level;
+    }
+
+    int getComboPoints(int combo, int level)
+    {
+        return combo > 0 ? comboPoints * combo * level : 0;
+    }
 
-        return maxOffset;
+    bool isLevelReached(int lines, int level)
+    {
+        return level < maxLevel and lines >= linesForLevel[level + 1];
     }
+};
 
-    int getOffsetBlockedByMino(int dropDist)
+// Preset boards and piece sequences, memory mapped and read in place: rows of '.' and '#' (aligned to the
+// floor), then "queue TIOSZLJ" and an optional "hold T", with a blank line after each puzzle
+class PuzzlePack
+{
+public:
+    struct Puzzle
     {
-        int offsetY = 0;
-        int maxOffset = 20;
+        StringView rows[Grid::rows]; // the lowest rows of the board, top first
+        int rowCount;
+        StringView queue;
+        int held; // shape id, 0 when the hold slot starts empty
+    };
 
-        while (offsetY < dropDist)
-        {
-            offsetY++;
-            for (int i = 0; i < 4; i++)
-            {
-                if (grid->getValue(tetromino->blocksCurrent[i].x, tetromino->blocksCurrent[i].y + offsetY))
-                {
-                    if (offsetY < maxOffset)
-                    {
-                        maxOffset = offsetY;
-                    }
-                }
-            }
-        }
+    int fd;
+    const char *data;
+    size_t size;
+    std::vector<StringView> puzzles; // each puzzle's lines, found in one pass when the pack opens
 
-        if (maxOffset != 20)
-        {
-            maxOffset--;
-        }
+    PuzzlePack() : fd(-1), data(NULL), size(0) {}
 
-        return maxOffset;
+    ~PuzzlePack()
+    {
+        close();
     }
 
-    int getHardDropOffsetY()
+    bool open(const char *filename)
     {
-        if (!isTetrominoInViewPort())
+        close();
+        fd = ::open(filename, O_RDONLY);
+        struct stat info;
+        if (fd < 0 or fstat(fd, &info) != 0)
         {
+            close();
             return 0;
         }
-
-        int lowestY = getLowestYoffset();
-        int maxDropDist = grid->rows - lowestY - 1;
-
-        if (maxDropDist > 0)
+        size = info.st_size;
+        if (size > 0)
         {
-            int maxOffsetByMino = getOffsetBlockedByMino(maxDropDist);
-            int maxOffsetByGrid = getOffsetBlockedByGrid(maxDropDist);
-
-            if (maxOffsetByMino < maxOffsetByGrid)
-            {
-                return maxOffsetByMino;
-            }
-            else if (maxOffsetByGrid)
+            void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
             {
-                return maxOffsetByGrid;
+                close();
+                return 0;
             }
+            data = (const char *)mapping;
         }
-
-        return 0;
+        index(StringView(data, size));
+        return 1;
     }
 
-    void placeTetrominoHere()
+    void close()
     {
-        for (int i = 0; i < 4; i++)
+        if (data)
         {
-            grid->grid[tetromino->blocksCurrent[i].y][tetromino->blocksCurrent[i].x] = tetromino->colorId;
+            munmap((void *)data, size);
+            data = NULL;
         }
-    }
-
-    bool isAtTopRow()
-    {
-        for (int i = 0; i < 4; i++)
+        if (fd >= 0)
         {
-            if (tetromino->blocksCurrent[i].y == 0)
-            {
-                return 1;
-            }
+            ::close(fd);
+            fd = -1;
         }
-        return 0;
+        size = 0;
+        puzzles.clear();
     }
 
-    int getWallKickDistanceX()
+    // Splits pack text on blank lines, keeping the blocks that have a queue; the text has to outlive them
+    void index(StringView pack)
     {
-        int dist = 0;
-        for (int i = 0; i < 4; i++)
+        StringView rest = pack;
+        const char *start = NULL;
+        bool queued = 0;
+        while (1)
         {
-            if (tetromino->blocksCurrent[i].x < 0)
+            bool more = !rest.empty();
+            const char *line = more ? rest.data : pack.data + pack.size; // an empty view has no data pointer
+            StringView text = rest.popLine();
+            if (!more or text.empty())
             {
-                if (0 - tetromino->blocksCurrent[i].x > dist)
+                if (start and queued)
                 {
-                    dist = 0 - tetromino->blocksCurrent[i].x;
+                    puzzles.push_back(StringView(start, line - start));
                 }
-            }
-            else if (tetromino->blocksCurrent[i].x > (grid->cols - 1))
-            {
-                if ((grid->cols - 1) - tetromino->blocksCurrent[i].x < dist)
+                start = NULL;
+                queued = 0;
+                if (!more)
                 {
-                    dist = (grid->cols - 1) - tetromino->blocksCurrent[i].x;
+                    break;
                 }
+                continue;
             }
-            else
-            {
-                // TODO wallkick from other blocks on grid
-            }
+            start = start ? start : line;
+            queued = queued or text.startsWith("queue ");
         }
-        return dist;
     }
 
-    bool isRowFull(int r)
+    int getCount()
     {
-        for (int c = 0; c < grid->cols; c++)
+        return puzzles.size();
+    }
+
+    bool get(int i, Puzzle &puzzle)
+    {
+        if (i < 0 or i >= getCount())
+        {
+            return 0;
+        }
+        puzzle.rowCount = 0;
+        puzzle.held = 0;
+        StringView rest = puzzles[i];
+        while (!rest.empty())
         {
-            if (grid->grid[r][c] == 0)
+            StringView line = rest.popLine();
+            if (line.startsWith("queue "))
             {
-                return 0;
+                puzzle.queue = line.substr(6);
+            }
+            else if (line.startsWith("hold "))
+            {
+                puzzle.held = PieceQueue::fromLetter(line.size > 5 ? line.data[5] : 0);
+            }
+            else if (!line.empty() and (line.front() == '.' or line.front() == '#'))
+            {
+                if (puzzle.rowCount == Grid::rows)
+                {
+                    std::copy(puzzle.rows + 1, puzzle.rows + Grid::rows, puzzle.rows); // taller than the board: keep the bottom
+                    puzzle.rowCount--;
+                }
+                puzzle.rows[puzzle.rowCount++] = line;
             }
         }
         return 1;
     }
+};
 
-    void moveRowDown(int r, int num)
+// Simulation ticks of a sprint or ultra run at every tenth line, with its result once finished
+class Splits
+{
+public:
+    static const int lines = 10; // lines between splits
+    static const int capacity = 32;
+
+    sf::Int64 ticks[capacity];
+    int count;
+    sf::Int64 finishTicks; // 0 while the run is going
+    int score;
+
+    void clear()
     {
-        for (int c = 0; c < grid->cols; c++)
+        memset(ticks, 0, sizeof(ticks));
+        count = 0;
+        finishTicks = 0;
+        score = 0;
+    }
+
+    // Sprints compare by time, ultras by score and then by time
+    bool isBetterThan(const Splits &other, int mode)
+    {
+        if (!other.finishTicks)
+        {
+            return finishTicks != 0;
+        }
+        if (mode == Rules::Ultra and score != other.score)
         {
-            grid->grid[r + num][c] = grid->grid[r][c];
-            grid->grid[r][c] = 0;
+            return score > other.score;
         }
+        return finishTicks < other.finishTicks;
     }
 
-    void clearRow(int r)
+    // One line: finish ticks, score, split count and the splits
+    bool load(const char *filename)
     {
-        for (int c = 0; c < grid->cols; c++)
+        clear();
+        std::ifstream inputFile(filename);
+        if (!(inputFile >> finishTicks >> score >> count))
+        {
+            clear();
+            return 0;
+        }
+        count = std::max(0, std::min(count, (int)capacity));
+        for (int i = 0; i < count; i++)
+        {
+            inputFile >> ticks[i];
+        }
+        if (!inputFile)
         {
-            specialEffects->createFxBlock(c, r, grid->grid[r][c]);
-            grid->grid[r][c] = 0;
+            clear();
+            return 0;
         }
+        return 1;
     }
 
-    int clearFullRows()
+    void save(const char *filename)
     {
-        int cleared = 0;
-        for (int r = grid->rows - 1; r >= 0; r--)
+        std::ofstream outputFile(filename);
+        outputFile << finishTicks << " " << score << " " << count;
+        for (int i = 0; i < count; i++)
         {
-            if (isRowFull(r))
-            {
-                clearRow(r);
-                cleared++;
-            }
-            else if (cleared > 0)
-            {
-                moveRowDown(r, cleared);
-            }
+            outputFile << " " << ticks[i];
         }
-        return cleared;
+        outputFile << "\n";
+    }
+};
+
+// Manages game states and holds current score
+class GameState
+{
+public:
+    int currentState;
+    int difficultyLevel;
+    int linesCleared;
+    int combo; // consecutive line-clearing locks minus one, -1 when the last lock cleared nothing
+    int shadowEnabled;
+    unsigned char heldPiece; // packed like PieceQueue ids, 0 when the hold slot is empty
+    int holdUsed;            // hold is allowed once per piece
+    Grid *grid;
+    Tetromino *tetromino;
+    PieceQueue *queue;
+    Random *random;
+    EventBus *events;
+    Rules *rules;
+    const char *highscoreFilename; // NULL keeps headless runs from touching the highscore
+    PuzzlePack *puzzles;           // NULL outside puzzle mode
+    int puzzleIndex;
+
+    // Sprint and ultra clock: ticks simulated while playing since the game started, so a replay
+    // reproduces every time exactly
+    sf::Int64 gameTicks;
+    Splits splits;
+    Splits bestSplits; // personal best of the mode
+
+    GameState(Grid *gridPtr, Tetromino *tetrominoPtr, PieceQueue *queuePtr, Random *randomPtr, EventBus *eventsPtr, Rules *rulesPtr)
+        : grid(gridPtr), tetromino(tetrominoPtr), queue(queuePtr), random(randomPtr), events(eventsPtr), rules(rulesPtr)
+    {
+        puzzles = NULL;
+        puzzleIndex = 0;
+        gameTicks = 0;
+        splits.clear();
+        bestSplits.clear();
+        heldPiece = 0;
+        holdUsed = 0;
+        currentState = Title;
+        difficultyLevel = 1;
+        linesCleared = 0;
+        combo = -1;
+        shadowEnabled = 1;
+        currentScore = 0;
+        highestScore = 0;
+        savedHighScore = 0;
+        highscoreFilename = "score.txt";
     }
 
-    void generateNewTetromino()
+    enum StateId
     {
-        int lastColorId = nextTetromino->colorId;
+        Title,
+        Playing,
+        Pause,
+        GameOver
+    };
 
-        *tetromino = *nextTetromino;
+    int currentScore;
+    int highestScore;
+    int savedHighScore; // what the highscore file holds, so it is only rewritten when beaten
 
-        switch (tetromino->shapeId)
+    void loadHighScore()
+    {
+        if (!highscoreFilename)
         {
-        case Tetromino::Shape_I:
-            tetromino->moveUp(4);
-            break;
-        case Tetromino::Shape_O:
-            tetromino->moveUp(2);
-            break;
-        default:
-            tetromino->moveUp(3);
-            break;
+            return;
+        }
+        std::ifstream inputFile(highscoreFilename);
+        inputFile >> highestScore;
+        inputFile.close();
+        savedHighScore = highestScore;
+    }
+
+    // Called at game over and on exit rather than per point, so a run writes the file once
+    void saveHighScore()
+    {
+        if (!highscoreFilename or highestScore == savedHighScore)
+        {
+            return;
         }
+        std::ofstream outputFile(highscoreFilename);
+        outputFile << highestScore;
+        outputFile.close();
+        savedHighScore = highestScore;
+    }
 
-        do
+    // Personal bests live next to the highscore, one file per timed mode
+    const char *getBestFilename()
+    {
+        if (!highscoreFilename or rules->mode == Rules::Marathon)
         {
-            tetromino->moveX((rand() % (grid->cols - 2)) + 1);
-        } while (!isCurrentPositionValid());
+            return NULL;
+        }
+        return rules->mode == Rules::Sprint ? "sprint.txt" : "ultra.txt";
+    }
 
-        *nextTetromino = Generator::getTetromino(lastColorId);
+    // Ticks behind (positive) or ahead of the personal best at the latest split, or live while the
+    // next split is later than the best's; false when the best has no split to compare with
+    bool getSplitDelta(sf::Int64 &delta)
+    {
+        if (splits.count < bestSplits.count and gameTicks > bestSplits.ticks[splits.count])
+        {
+            delta = gameTicks - bestSplits.ticks[splits.count];
+            return 1;
+        }
+        if (splits.count > 0 and splits.count <= bestSplits.count)
+        {
+            delta = splits.ticks[splits.count - 1] - bestSplits.ticks[splits.count - 1];
+            return 1;
+        }
+        return 0;
     }
 
-    bool isCurrentPositionValid(int offsetY = 0)
+    // Ends a timed run that reached its goal, keeping it when it beats the personal best
+    void finishRun()
     {
-        for (int i = 0; i < 4; i++)
+        splits.finishTicks = std::max(gameTicks, (sf::Int64)1);
+        splits.score = currentScore;
+        if (splits.isBetterThan(bestSplits, rules->mode))
         {
-            if (tetromino->blocksCurrent[i].x < 0)
+            bestSplits = splits;
+            if (getBestFilename())
             {
-                return 0;
+                bestSplits.save(getBestFilename());
             }
+        }
+    }
 
-            if (tetromino->blocksCurrent[i].x >= grid->cols)
+    // Returns true when the event was consumed by a state transition
+    bool handleInput(const InputEvent &event)
+    {
+        switch (currentState)
+        {
+        case Title:
+
+            if (event.type == InputEvent::HardDrop)
             {
-                return 0;
+                startGame();
+                return 1;
             }
 
-            if (tetromino->blocksCurrent[i].y + offsetY >= grid->rows)
+            break;
+
+        case Playing:
+
+            if (event.type == InputEvent::Pause)
             {
-                return 0;
+                currentState = Pause;
+                return 1;
             }
 
-            if (tetromino->blocksCurrent[i].y + offsetY >= 0 and grid->getValue(tetromino->blocksCurrent[i].x, tetromino->blocksCurrent[i].y + offsetY))
+            if (event.type == InputEvent::ShadowSwitch)
             {
-                return 0;
+                shadowEnabled *= -1;
+                return 1;
             }
-        }
-        return 1;
-    }
-
-    bool isPositionAfterNextDropValid()
-    {
-        return isCurrentPositionValid(1);
-    }
-};
 
-class Tetris
-{
-public:
-    sf::RenderWindow window;
+            break;
 
-    Grid grid;
+        case Pause:
 
-    Tetromino tetromino;
-    Tetromino nextTetromino;
+            if (event.type == InputEvent::Pause)
+            {
+                currentState = Playing;
+                return 1;
+            }
+
+            break;
+
+        case GameOver:
+
+            if (event.type == InputEvent::HardDrop)
+            {
+                grid->clear();
+                startGame();
+                return 1;
+            }
+
+            break;
+
+        default:
+            break;
+        }
+
+        if (puzzles and currentState != Title and (event.type == InputEvent::NextPuzzle or event.type == InputEvent::RestartPuzzle))
+        {
+            if (event.type == InputEvent::NextPuzzle)
+            {
+                nextPuzzle();
+            }
+            else
+            {
+                startGame();
+            }
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // A fresh game on the board as it is, or on the current puzzle's board and queue in puzzle mode
+    void startGame()
+    {
+        currentState = Playing;
+        currentScore = 0;
+        difficultyLevel = 1;
+        linesCleared = 0;
+        combo = -1;
+        saveHighScore(); // a restart or next puzzle skips game over
+        loadHighScore();
+        gameTicks = 0;
+        splits.clear();
+        if (getBestFilename())
+        {
+            bestSplits.load(getBestFilename());
+        }
+        PuzzlePack::Puzzle puzzle;
+        bool puzzled = puzzles and puzzles->get(puzzleIndex, puzzle);
+        if (puzzled)
+        {
+            loadPuzzle(puzzle);
+        }
+        events->publish(GameEvent::GameStarted);
+        startPieces();
+        if (puzzled and puzzle.held)
+        {
+            heldPiece = PieceQueue::pack(puzzle.held, queue->getColorId());
+        }
+    }
+
+    void nextPuzzle()
+    {
+        puzzleIndex = (puzzleIndex + 1) % puzzles->getCount();
+        startGame();
+    }
+
+    // Fills the board from the bottom with grey garbage and deals the puzzle's queue before any bag
+    void loadPuzzle(const PuzzlePack::Puzzle &puzzle)
+    {
+        grid->clear();
+        for (int r = 0; r < puzzle.rowCount; r++)
+        {
+            int y = grid->rows - puzzle.rowCount + r;
+            int *row = grid->getRow(y);
+            for (int x = 0; x < grid->cols and x < (int)puzzle.rows[r].size; x++)
+            {
+                row[x] = puzzle.rows[r].data[x] == '#' ? Colors::Grey : 0;
+            }
+            grid->updateRowMask(y);
+        }
+        queue->script = puzzle.queue;
+    }
+
+    void addScore(int points)
+    {
+        if (points == 0)
+        {
+            return;
+        }
+        currentScore += points;
+        events->publish(GameEvent::ScoreChanged, points);
+
+        if (currentScore > highestScore)
+        {
+            highestScore = currentScore; // TODO render congratulations
+        }
+    }
+
+    // Scores a lock that cleared the given number of lines (0 breaks the combo)
+    void addLines(int lines)
+    {
+        if (lines == 0)
+        {
+            combo = -1;
+            return;
+        }
+
+        combo++;
+        addScore(rules->getLineClearPoints(lines, difficultyLevel) + rules->getComboPoints(combo, difficultyLevel));
+
+        linesCleared += lines;
+        while (rules->mode != Rules::Marathon and splits.count < Splits::capacity and linesCleared >= (splits.count + 1) * Splits::lines)
+        {
+            splits.ticks[splits.count++] = gameTicks;
+            events->publish(GameEvent::SplitReached, splits.count);
+        }
+        while (rules->isLevelReached(linesCleared, difficultyLevel))
+        {
+            difficultyLevel++;
+            events->publish(GameEvent::LevelUp, difficultyLevel);
+        }
+    }
+
+    void startPieces()
+    {
+        queue->reset();
+        heldPiece = 0;
+        generateNewTetromino();
+    }
+
+    bool generateNewTetromino()
+    {
+        holdUsed = 0;
+        return spawnTetromino(queue->pop());
+    }
+
+    // Swaps the falling piece with the held one, or with the next piece when nothing is held
+    bool holdTetromino()
+    {
+        if (holdUsed)
+        {
+            return 0;
+        }
+
+        unsigned char current = PieceQueue::pack(tetromino->shapeId, tetromino->colorId);
+        spawnTetromino(heldPiece ? heldPiece : queue->pop());
+        heldPiece = current;
+        holdUsed = 1;
+        return 1;
+    }
+
+    // False when the piece fits in no column the spawn policy allows; it is then left overlapping the
+    // stack at the center, so the position check after a hold sees the block out too
+    bool spawnTetromino(unsigned char piece)
+    {
+        *tetromino = Generator::getTetromino(PieceQueue::getShapeId(piece), PieceQueue::getColorId(piece));
+        tetromino->moveUp(2); // spawn rows sit just above the board
+
+        unsigned masks[4];
+        tetromino->getRowMasks(masks);
+        unsigned fits = grid->getFreeShifts(masks, tetromino->getBox().y) >> Grid::wallBits;
+        int x = Rules::chooseSpawnColumn(fits, tetromino->boxSize, rules->spawnPolicy, *random);
+        tetromino->moveX(x >= 0 ? x : (grid->cols - tetromino->boxSize) / 2);
+        events->publish(GameEvent::PieceSpawned, tetromino->shapeId);
+        return x >= 0;
+    }
+};
+
+// Flying blocks container
+class SpecialEffects : public EventListener
+{
+public:
+    // One update per 1/60 s of play, the frame the effects were tuned at, whatever the tick length;
+    // durations in updates
+    static const int updateMicroseconds = 1000000 / 60;
+    static const int flashUpdates = 10;
+    static const int shakeUpdates = 16;
+
+    std::vector<FxBlock> fxBlocks; // by value, so a copy of the effects owns its blocks
+    Random *random;
+    int flashTimers[Grid::rows]; // updates left on each cleared row's flash
+    int shakeTimer;
+    int shakeAmplitude; // pixels
+
+    SpecialEffects(Random *randomPtr) : random(randomPtr), shakeTimer(0), shakeAmplitude(0)
+    {
+        fxBlocks.reserve(4 * Grid::cols);
+        std::fill(flashTimers, flashTimers + Grid::rows, 0);
+    }
+
+    void clear()
+    {
+        fxBlocks.clear();
+        std::fill(flashTimers, flashTimers + Grid::rows, 0);
+        shakeTimer = 0;
+    }
+
+    // Playfield offset while shaking, whole pixels, fading out over the shake
+    void getShakeOffset(int &x, int &y)
+    {
+        float strength = shakeAmplitude * (float)shakeTimer / shakeUpdates;
+        x = shakeTimer > 0 ? (int)std::floor(strength * std::sin(shakeTimer * 1.9f) + 0.5f) : 0;
+        y = shakeTimer > 0 ? (int)std::floor(strength * std::cos(shakeTimer * 1.3f) + 0.5f) : 0;
+    }
+
+    void createFxBlock(int x, int y, int c)
+    {
+        fxBlocks.push_back(FxBlock(x * 32, y * 32, c, *random));
+    }
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].type == GameEvent::RowCleared)
+            {
+                for (int c = 0; c < Grid::cols; c++)
+                {
+                    createFxBlock(c, events[i].value, events[i].colors[c]);
+                }
+                if (events[i].value >= 0)
+                {
+                    flashTimers[events[i].value] = flashUpdates;
+                }
+            }
+            else if (events[i].type == GameEvent::LinesCleared)
+            {
+                shakeTimer = shakeUpdates;
+                shakeAmplitude = std::min(2 * events[i].value, 8);
+            }
+        }
+    }
+
+    void removeFxBlocks()
+    {
+        for (std::vector<FxBlock>::iterator it = fxBlocks.begin(); it != fxBlocks.end(); ++it)
+        {
+            if (it->y > (Grid::rows * 32) or it->x < 0 || it->x > (Grid::cols * 32))
+            {
+                fxBlocks.erase(it);
+                break;
+            }
+        }
+    }
+
+    void updateFxBlocks()
+    {
+        for (std::vector<FxBlock>::iterator it = fxBlocks.begin(); it != fxBlocks.end(); ++it)
+        {
+            it->update(0.01);
+        }
+
+        for (int r = 0; r < Grid::rows; r++)
+        {
+            flashTimers[r] = std::max(flashTimers[r] - 1, 0);
+        }
+        shakeTimer = std::max(shakeTimer - 1, 0);
+    }
+};
+
+// Counters of one game, filled from event batches
+class GameStats
+{
+public:
+    int gameId;
+    bool finished;
+    int score;
+    sf::Int64 startTick;
+    sf::Int64 endTick;
+    int pieces;
+    int inputs;
+    int finesseFaults;
+    int clears[5];                  // index: lines cleared at once, 1..4
+    std::vector<sf::Uint8> heights; // stack height after each lock
+    std::vector<sf::Int64> levelTicks; // tick each level was reached, from level 1
+
+    GameStats(int gameId, sf::Int64 startTick) : gameId(gameId), finished(0), score(0), startTick(startTick), endTick(startTick), pieces(0), inputs(0), finesseFaults(0)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            clears[i] = 0;
+        }
+        heights.reserve(1024);
+        levelTicks.push_back(startTick);
+    }
+};
+
+// Appends finished games to CSV tables from a background thread, a batch at a time:
+// games.csv (one row per game), heights.csv (per piece) and levels.csv (per level)
+class StatsWriter
+{
+public:
+    static const int queueSize = 256;
+    static const int batchSize = 64;
+    RingBuffer<GameStats *, queueSize> queue;
+    std::atomic<bool> closing;
+    std::thread worker;
+    std::ofstream gamesFile, heightsFile, levelsFile;
+    std::string games, heights, levels; // rows of the batch being built
+    int batched;
+    int droppedGames;
+
+    StatsWriter(const std::string &directory) : closing(0), batched(0), droppedGames(0)
+    {
+        gamesFile.open((directory + "/games.csv").c_str());
+        heightsFile.open((directory + "/heights.csv").c_str());
+        levelsFile.open((directory + "/levels.csv").c_str());
+        gamesFile << "game,finished,score,seconds,pieces,pieces_per_second,inputs_per_piece,finesse_faults,singles,doubles,triples,tetrises,level\n";
+        heightsFile << "game,piece,height\n";
+        levelsFile << "game,level,seconds\n";
+        worker = std::thread(&StatsWriter::writeLoop, this);
+    }
+
+    ~StatsWriter()
+    {
+        close();
+    }
+
+    bool isOpen()
+    {
+        return gamesFile.is_open() and heightsFile.is_open() and levelsFile.is_open();
+    }
+
+    // Called from the game thread; ownership of the stats passes to the writer
+    void submit(GameStats *stats)
+    {
+        if (!queue.push(stats))
+        {
+            droppedGames++;
+            delete stats;
+        }
+    }
+
+    void close()
+    {
+        if (worker.joinable())
+        {
+            closing = 1;
+            worker.join();
+            flush();
+        }
+    }
+
+    void writeLoop()
+    {
+        for (;;)
+        {
+            GameStats *stats;
+            if (queue.pop(stats))
+            {
+                append(stats);
+                delete stats;
+                if (++batched >= batchSize)
+                {
+                    flush();
+                }
+            }
+            else if (closing)
+            {
+                break;
+            }
+            else
+            {
+                sf::sleep(sf::milliseconds(5));
+            }
+        }
+    }
+
+    void append(GameStats *stats)
+    {
+        char row[256];
+        float seconds = (stats->endTick - stats->startTick) / 1000.f;
+        snprintf(row, sizeof(row), "%d,%d,%d,%.3f,%d,%.3f,%.3f,%d,%d,%d,%d,%d,%d\n",
+                 stats->gameId, stats->finished, stats->score, seconds, stats->pieces,
+                 seconds > 0 ? stats->pieces / seconds : 0.f,
+                 stats->pieces ? (float)stats->inputs / stats->pieces : 0.f,
+                 stats->finesseFaults, stats->clears[1], stats->clears[2], stats->clears[3], stats->clears[4],
+                 (int)stats->levelTicks.size());
+        games += row;
+
+        for (size_t i = 0; i < stats->heights.size(); i++)
+        {
+            snprintf(row, sizeof(row), "%d,%d,%d\n", stats->gameId, (int)i, stats->heights[i]);
+            heights += row;
+        }
+
+        for (size_t i = 0; i < stats->levelTicks.size(); i++)
+        {
+            sf::Int64 end = i + 1 < stats->levelTicks.size() ? stats->levelTicks[i + 1] : stats->endTick;
+            snprintf(row, sizeof(row), "%d,%d,%.3f\n", stats->gameId, (int)i + 1, (end - stats->levelTicks[i]) / 1000.f);
+            levels += row;
+        }
+    }
+
+    void flush()
+    {
+        gamesFile << games;
+        heightsFile << heights;
+        levelsFile << levels;
+        gamesFile.flush();
+        heightsFile.flush();
+        levelsFile.flush();
+        games.clear();
+        heights.clear();
+        levels.clear();
+        batched = 0;
+    }
+};
+
+// Collects per-game statistics from the event bus; the game thread only bumps counters
+class Stats : public EventListener
+{
+public:
+    Grid *grid;
+    StatsWriter *writer;
+    GameStats *current;
+    int nextGameId;
+    sf::Int64 lastTick;
+
+    Stats(Grid *gridPtr, StatsWriter *writerPtr) : grid(gridPtr), writer(writerPtr), current(NULL), nextGameId(1), lastTick(0) {}
+
+    ~Stats()
+    {
+        finish();
+    }
+
+    int getStackHeight()
+    {
+        for (int y = 0; y < Grid::rows; y++)
+        {
+            for (int x = 0; x < Grid::cols; x++)
+            {
+                if (grid->grid[y][x])
+                {
+                    return Grid::rows - y;
+                }
+            }
+        }
+        return 0;
+    }
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const GameEvent &event = events[i];
+            lastTick = event.tick;
+
+            if (event.type == GameEvent::GameStarted)
+            {
+                finish();
+                current = new GameStats(nextGameId++, event.tick);
+                continue;
+            }
+
+            if (!current)
+            {
+                continue;
+            }
+
+            switch (event.type)
+            {
+            case GameEvent::PieceLocked:
+                current->pieces++;
+                current->inputs += event.inputs;
+                current->finesseFaults += event.inputs > event.minimumInputs;
+                current->heights.push_back(getStackHeight());
+                break;
+            case GameEvent::LinesCleared:
+                current->clears[std::min(event.value, 4)]++;
+                break;
+            case GameEvent::LevelUp:
+                current->levelTicks.push_back(event.tick);
+                break;
+            case GameEvent::GameEnded:
+                current->finished = 1;
+                current->score = event.value;
+                finish();
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Hands the current game to the writer, unfinished if the session stopped mid-game
+    void finish()
+    {
+        if (current)
+        {
+            current->endTick = lastTick;
+            writer->submit(current);
+            current = NULL;
+        }
+    }
+};
+
+// Four RGBA pixels, as bytes and widened for blending
+typedef sf::Uint8 PixelBytes __attribute__((vector_size(16)));
+typedef unsigned short PixelWords __attribute__((vector_size(32)));
+
+// CPU-side RGBA image the View can rasterize tiles into without a window or GPU; pixels are premultiplied,
+// opaque after clear() and transparent after clearTransparent()
+class FrameBuffer
+{
+public:
+    int width, height;
+    std::vector<sf::Uint8> pixels;
+
+    FrameBuffer(int width, int height) : width(width), height(height), pixels(width * height * 4) {}
+
+    void clear(sf::Color color)
+    {
+        fillRect(0, 0, width, height, sf::Color(color.r, color.g, color.b));
+    }
+
+    void clearTransparent()
+    {
+        std::fill(pixels.begin(), pixels.end(), 0);
+    }
+
+    // Fills a rectangle, blending with the alpha of the color
+    void fillRect(int x, int y, int w, int h, sf::Color color)
+    {
+        int x0 = std::max(x, 0), y0 = std::max(y, 0);
+        int x1 = std::min(x + w, width), y1 = std::min(y + h, height);
+        if (x1 <= x0)
+        {
+            return;
+        }
+
+        for (int py = y0; py < y1; py++)
+        {
+            blendRow(&pixels[(py * width + x0) * 4], x1 - x0, color);
+        }
+    }
+
+    // Same result as blendPixel on each pixel, four pixels per step in 16-bit lanes
+    static void blendRow(sf::Uint8 *p, int count, sf::Color color)
+    {
+        int a = color.a, ia = 255 - color.a;
+        PixelWords source;
+        for (int c = 0; c < 16; c += 4)
+        {
+            source[c] = color.r * a;
+            source[c + 1] = color.g * a;
+            source[c + 2] = color.b * a;
+            source[c + 3] = 255 * a;
+        }
+        PixelWords inverse = PixelWords() + (unsigned short)ia;
+
+        int i = 0;
+        for (; i + 4 <= count; i += 4, p += 16)
+        {
+            PixelBytes bytes;
+            memcpy(&bytes, p, sizeof(bytes));
+            PixelWords v = source + __builtin_convertvector(bytes, PixelWords) * inverse;
+            v = (v + 1 + (v >> 8)) >> 8; // v / 255, exact up to 255 * 255
+            bytes = __builtin_convertvector(v, PixelBytes);
+            memcpy(p, &bytes, sizeof(bytes));
+        }
+        for (; i < count; i++, p += 4)
+        {
+            blendPixel(p, color);
+        }
+    }
+
+    // Color over a premultiplied pixel; an opaque pixel stays opaque
+    static void blendPixel(sf::Uint8 *p, sf::Color color)
+    {
+        int a = color.a, ia = 255 - color.a;
+        p[0] = (color.r * a + p[0] * ia) / 255;
+        p[1] = (color.g * a + p[1] * ia) / 255;
+        p[2] = (color.b * a + p[2] * ia) / 255;
+        p[3] = (255 * a + p[3] * ia) / 255;
+    }
+
+    // FNV-1a over all pixels, changes with any single pixel
+    sf::Uint64 exactHash()
+    {
+        sf::Uint64 hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < pixels.size(); i++)
+        {
+            hash = (hash ^ pixels[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Average hash of an 8x8 grayscale downsample, close images differ in few bits
+    sf::Uint64 perceptualHash()
+    {
+        int cells[64] = {0};
+        int counts[64] = {0};
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                const sf::Uint8 *p = &pixels[(y * width + x) * 4];
+                int cell = (y * 8 / height) * 8 + (x * 8 / width);
+                cells[cell] += (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+                counts[cell]++;
+            }
+        }
+
+        int total = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            cells[i] /= std::max(counts[i], 1);
+            total += cells[i];
+        }
+
+        sf::Uint64 hash = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            if (cells[i] * 64 > total)
+            {
+                hash |= 1ULL << i;
+            }
+        }
+        return hash;
+    }
+
+    bool saveToFile(const std::string &filename)
+    {
+        sf::Image image;
+        image.create(width, height, &pixels[0]);
+        return image.saveToFile(filename);
+    }
+};
+
+// Streams frames to an animated GIF or raw Y4M file from a background thread.
+// Frames circulate between a fixed pool and the encoder through two lock-free
+// queues, so the game renders straight into the buffer that gets encoded.
+class FrameEncoder
+{
+public:
+    static const int poolSize = 8;
+    FrameBuffer *pool[poolSize];
+    RingBuffer<FrameBuffer *, poolSize> freeFrames;   // encoder -> game
+    RingBuffer<FrameBuffer *, poolSize> filledFrames; // game -> encoder
+    std::atomic<bool> closing;
+    std::thread worker;
+    std::ofstream outputFile;
+    bool gif;
+    int fps;
+    int droppedFrames;
+    std::vector<sf::Uint8> planes;
+    std::vector<sf::Uint8> indices;
+
+    FrameEncoder(const char *filename, int width, int height, int fps) : closing(0), outputFile(filename, std::ios::binary), fps(fps), droppedFrames(0)
+    {
+        const char *extension = strrchr(filename, '.');
+        gif = extension and strcmp(extension, ".gif") == 0;
+
+        for (int i = 0; i < poolSize; i++)
+        {
+            pool[i] = new FrameBuffer(width, height);
+            freeFrames.push(pool[i]);
+        }
+
+        if (gif)
+        {
+            writeGifHeader(width, height);
+        }
+        else
+        {
+            outputFile << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+        }
+
+        worker = std::thread(&FrameEncoder::encodeLoop, this);
+    }
+
+    ~FrameEncoder()
+    {
+        close();
+        for (int i = 0; i < poolSize; i++)
+        {
+            delete pool[i];
+        }
+    }
+
+    bool isOpen()
+    {
+        return outputFile.is_open();
+    }
+
+    // Returns a buffer to render into; without waiting, NULL means the frame is dropped
+    FrameBuffer *acquire(bool wait)
+    {
+        FrameBuffer *frame;
+        while (!freeFrames.pop(frame))
+        {
+            if (!wait)
+            {
+                droppedFrames++;
+                return NULL;
+            }
+            sf::sleep(sf::milliseconds(1));
+        }
+        return frame;
+    }
+
+    void submit(FrameBuffer *frame)
+    {
+        filledFrames.push(frame); // cannot fail, the queue holds the whole pool
+    }
+
+    // Encodes the frames still queued and finishes the file
+    void close()
+    {
+        if (worker.joinable())
+        {
+            closing = 1;
+            worker.join();
+            if (gif)
+            {
+                outputFile.put(0x3B); // trailer
+            }
+            outputFile.close();
+        }
+    }
+
+    void encodeLoop()
+    {
+        for (;;)
+        {
+            FrameBuffer *frame;
+            if (filledFrames.pop(frame))
+            {
+                if (gif)
+                {
+                    writeGifFrame(frame);
+                }
+                else
+                {
+                    writeY4mFrame(frame);
+                }
+                freeFrames.push(frame);
+            }
+            else if (closing)
+            {
+                break;
+            }
+            else
+            {
+                sf::sleep(sf::milliseconds(1));
+            }
+        }
+    }
+
+    void writeY4mFrame(FrameBuffer *frame)
+    {
+        int w = frame->width, h = frame->height;
+        int cw = (w + 1) / 2, ch = (h + 1) / 2;
+        planes.resize(w * h + 2 * cw * ch);
+        sf::Uint8 *y = &planes[0];
+        sf::Uint8 *u = y + w * h;
+        sf::Uint8 *v = u + cw * ch;
+
+        // Full-range BT.601, chroma taken from the top-left pixel of each 2x2 block
+        for (int py = 0; py < h; py++)
+        {
+            for (int px = 0; px < w; px++)
+            {
+                const sf::Uint8 *p = &frame->pixels[(py * w + px) * 4];
+                y[py * w + px] = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+                if (!(px & 1) and !(py & 1))
+                {
+                    u[(py / 2) * cw + px / 2] = (-43 * p[0] - 85 * p[1] + 128 * p[2] + 32768) >> 8;
+                    v[(py / 2) * cw + px / 2] = (128 * p[0] - 107 * p[1] - 21 * p[2] + 32768) >> 8;
+                }
+            }
+        }
+
+        outputFile << "FRAME\n";
+        outputFile.write((const char *)&planes[0], planes.size());
+    }
+
+    // Fixed 6x7x6 color cube, so every frame shares the global palette
+    static int paletteIndex(const sf::Uint8 *p)
+    {
+        return (p[0] * 6 / 256) * 42 + (p[1] * 7 / 256) * 6 + (p[2] * 6 / 256);
+    }
+
+    void writeGifHeader(int width, int height)
+    {
+        outputFile.write("GIF89a", 6);
+        writeShort(width);
+        writeShort(height);
+        outputFile.put((char)0xF7); // global color table of 256 entries
+        outputFile.put(0);
+        outputFile.put(0);
+        for (int i = 0; i < 256; i++)
+        {
+            int r = i / 42, g = (i / 6) % 7, b = i % 6;
+            outputFile.put(i < 252 ? r * 255 / 5 : 0);
+            outputFile.put(i < 252 ? g * 255 / 6 : 0);
+            outputFile.put(i < 252 ? b * 255 / 5 : 0);
+        }
+
+        const char loop[] = {0x21, (char)0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+        outputFile.write(loop, sizeof(loop));
+    }
+
+    void writeShort(int value)
+    {
+        outputFile.put(value & 0xFF);
+        outputFile.put((value >> 8) & 0xFF);
+    }
+
+    void writeGifFrame(FrameBuffer *frame)
+    {
+        const char control[] = {0x21, (char)0xF9, 0x04, 0x00};
+        outputFile.write(control, sizeof(control));
+        writeShort(std::max(100 / fps, 2)); // delay in 1/100 s
+        outputFile.put(0);
+        outputFile.put(0);
+
+        outputFile.put(0x2C);
+        writeShort(0);
+        writeShort(0);
+        writeShort(frame->width);
+        writeShort(frame->height);
+        outputFile.put(0);
+
+        int count = frame->width * frame->height;
+        indices.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            indices[i] = paletteIndex(&frame->pixels[i * 4]);
+        }
+        writeLzw(&indices[0], count);
+    }
+
+    // Variable-length LZW as required by GIF, dictionary kept in an open-addressing table
+    void writeLzw(const sf::Uint8 *data, int count)
+    {
+        const int clearCode = 256, endCode = 257, tableSize = 8192;
+        std::vector<int> keys(tableSize, -1), values(tableSize);
+        std::vector<char> block;
+        unsigned bits = 0;
+        int bitCount = 0;
+        int codeSize = 9, nextCode = 258;
+
+        outputFile.put(8);
+
+        struct Emitter
+        {
+            static void emit(int code, int size, unsigned &bits, int &bitCount, std::vector<char> &block, std::ofstream &out)
+            {
+                bits |= code << bitCount;
+                bitCount += size;
+                while (bitCount >= 8)
+                {
+                    block.push_back(bits & 0xFF);
+                    bits >>= 8;
+                    bitCount -= 8;
+                    if (block.size() == 255)
+                    {
+                        out.put((char)255);
+                        out.write(&block[0], 255);
+                        block.clear();
+                    }
+                }
+            }
+        };
+
+        Emitter::emit(clearCode, codeSize, bits, bitCount, block, outputFile);
+        int prefix = data[0];
+        for (int i = 1; i < count; i++)
+        {
+            int key = (prefix << 8) | data[i];
+            int slot = (key * 2654435761u) >> 19 & (tableSize - 1);
+            while (keys[slot] != -1 and keys[slot] != key)
+            {
+                slot = (slot + 1) & (tableSize - 1);
+            }
+
+            if (keys[slot] == key)
+            {
+                prefix = values[slot];
+                continue;
+            }
+
+            Emitter::emit(prefix, codeSize, bits, bitCount, block, outputFile);
+            if (nextCode < 4096)
+            {
+                keys[slot] = key;
+                values[slot] = nextCode++;
+                if (nextCode > (1 << codeSize) and codeSize < 12)
+                {
+                    codeSize++;
+                }
+            }
+            else
+            {
+                Emitter::emit(clearCode, codeSize, bits, bitCount, block, outputFile);
+                std::fill(keys.begin(), keys.end(), -1);
+                codeSize = 9;
+                nextCode = 258;
+            }
+            prefix = data[i];
+        }
+
+        Emitter::emit(prefix, codeSize, bits, bitCount, block, outputFile);
+        Emitter::emit(endCode, codeSize, bits, bitCount, block, outputFile);
+        if (bitCount > 0)
+        {
+            block.push_back(bits & 0xFF);
+        }
+        if (!block.empty())
+        {
+            outputFile.put(block.size());
+            outputFile.write(&block[0], block.size());
+        }
+        outputFile.put(0);
+    }
+};
+
+// Sound effects synthesized once at startup into 16-bit mono PCM
+class SoundBank
+{
+public:
+    enum SoundId
+    {
+        Lock,
+        Rotate,
+        LineClear,
+        LevelUp,
+        SoundCount
+    };
+
+    static const int sampleRate = 48000;
+    std::vector<sf::Int16> samples[SoundCount];
+
+    SoundBank()
+    {
+        addTone(samples[Lock], 110, 110, 0.06, 0);
+        addTone(samples[Rotate], 880, 880, 0.03, 1);
+        addTone(samples[LineClear], 440, 1320, 0.25, 0);
+        addTone(samples[LevelUp], 523, 523, 0.1, 1);
+        addTone(samples[LevelUp], 659, 659, 0.1, 1);
+        addTone(samples[LevelUp], 784, 784, 0.2, 1);
+    }
+
+    // Appends a decaying sine or square tone sweeping linearly between two frequencies
+    static void addTone(std::vector<sf::Int16> &out, float fromHz, float toHz, float seconds, bool square)
+    {
+        int count = seconds * sampleRate;
+        float phase = 0;
+        for (int i = 0; i < count; i++)
+        {
+            float t = (float)i / count;
+            phase += 2 * 3.14159265 * (fromHz + (toHz - fromHz) * t) / sampleRate;
+            float wave = square ? (sin(phase) > 0 ? 1 : -1) : sin(phase);
+            out.push_back(wave * 6000 * (1 - t));
+        }
+    }
+};
+
+// Request from the game thread to start a sound
+class AudioCommand
+{
+public:
+    int soundId;
+    int volume; // 0..256
+
+    AudioCommand() : soundId(0), volume(256) {}
+    AudioCommand(int soundId, int volume) : soundId(soundId), volume(volume) {}
+};
+
+// Mixes a fixed pool of voices. play() is the only call from the game thread and
+// just pushes a command into the lock-free queue; mix() runs on the audio thread.
+class Mixer : public EventListener
+{
+public:
+    static const int voiceCount = 16;
+
+    struct Voice
+    {
+        int soundId; // -1 when free
+        int position;
+        int volume;
+    };
+
+    SoundBank *bank;
+    RingBuffer<AudioCommand, 64> commands;
+    Voice voices[voiceCount];
+
+    Mixer(SoundBank *bankPtr) : bank(bankPtr)
+    {
+        for (int i = 0; i < voiceCount; i++)
+        {
+            voices[i].soundId = -1;
+        }
+    }
+
+    void play(int soundId, int volume = 256)
+    {
+        commands.push(AudioCommand(soundId, volume)); // a full queue drops the sound rather than block
+    }
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            switch (events[i].type)
+            {
+            case GameEvent::PieceRotated:
+                play(SoundBank::Rotate);
+                break;
+            case GameEvent::PieceLocked:
+                play(events[i].value ? SoundBank::LineClear : SoundBank::Lock);
+                break;
+            case GameEvent::LevelUp:
+                play(SoundBank::LevelUp);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    int getRemaining(const Voice &voice)
+    {
+        return (int)bank->samples[voice.soundId].size() - voice.position;
+    }
+
+    void startVoice(const AudioCommand &command)
+    {
+        // Take a free voice, or steal the one with the fewest samples left to play
+        int chosen = 0;
+        for (int i = 0; i < voiceCount; i++)
+        {
+            if (voices[i].soundId < 0)
+            {
+                chosen = i;
+                break;
+            }
+            if (getRemaining(voices[i]) < getRemaining(voices[chosen]))
+            {
+                chosen = i;
+            }
+        }
+        voices[chosen].soundId = command.soundId;
+        voices[chosen].position = 0;
+        voices[chosen].volume = command.volume;
+    }
+
+    void mix(sf::Int16 *out, int count)
+    {
+        AudioCommand command;
+        while (commands.pop(command))
+        {
+            startVoice(command);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            int sum = 0;
+            for (int v = 0; v < voiceCount; v++)
+            {
+                Voice &voice = voices[v];
+                if (voice.soundId >= 0)
+                {
+                    const std::vector<sf::Int16> &sound = bank->samples[voice.soundId];
+                    sum += (sound[voice.position++] * voice.volume) >> 8;
+                    if (voice.position >= (int)sound.size())
+                    {
+                        voice.soundId = -1;
+                    }
+                }
+            }
+            out[i] = std::max(-32768, std::min(sum, 32767));
+        }
+    }
+};
+
+// Live output: SFML pulls small chunks from the mixer on its own streaming thread.
+// 128 samples per chunk at 48 kHz keeps the queued audio under 10 ms.
+class AudioStream : public sf::SoundStream
+{
+public:
+    static const int chunkSize = 128;
+    Mixer *mixer;
+    sf::Int16 chunk[chunkSize];
+
+    AudioStream(Mixer *mixerPtr) : mixer(mixerPtr)
+    {
+        initialize(1, SoundBank::sampleRate);
+        setProcessingInterval(sf::milliseconds(1));
+    }
+
+    ~AudioStream()
+    {
+        stop(); // the streaming thread must not call onGetData on a destroyed object
+    }
+
+    bool onGetData(Chunk &data)
+    {
+        mixer->mix(chunk, chunkSize);
+        data.samples = chunk;
+        data.sampleCount = chunkSize;
+        return 1;
+    }
+
+    void onSeek(sf::Time)
+    {
+    }
+};
+
+// Offline output: mixes in step with the simulation clock and saves a WAV file
+class WavOutput
+{
+public:
+    Mixer *mixer;
+    std::vector<sf::Int16> samples;
+    sf::Int64 mixedMicroseconds;
+
+    WavOutput(Mixer *mixerPtr) : mixer(mixerPtr), mixedMicroseconds(0) {}
+
+    void advanceTo(sf::Int64 microseconds)
+    {
+        size_t target = microseconds * SoundBank::sampleRate / 1000000;
+        if (target > samples.size())
+        {
+            size_t start = samples.size();
+            samples.resize(target);
+            mixer->mix(&samples[start], target - start);
+        }
+        mixedMicroseconds = microseconds;
+    }
+
+    bool save(const char *filename)
+    {
+        std::ofstream outputFile(filename, std::ios::binary);
+        int dataSize = samples.size() * 2;
+        int header[] = {0x46464952, 36 + dataSize, 0x45564157, 0x20746D66, 16, 0x00010001, SoundBank::sampleRate, SoundBank::sampleRate * 2, 0x00100002, 0x61746164, dataSize};
+        outputFile.write((const char *)header, sizeof(header)); // little-endian RIFF header
+        if (dataSize)
+        {
+            outputFile.write((const char *)&samples[0], dataSize);
+        }
+        return outputFile.good();
+    }
+};
+
+// Assets compiled into the binary, verified before any window is opened
+class Assets
+{
+public:
+    sf::Font font;
+
+    bool load()
+    {
+        return font.loadFromMemory(retro_ttf, retro_ttf_len);
+    }
+
+    // Rasterizes the glyphs of every text size the View uses, needs an active GL context
+    // Text is rasterized at window scale, see View::draw
+    void prewarmGlyphs(float scale = 1)
+    {
+        const unsigned sizes[] = {13, 20, 22, 28, 32, 55};
+        for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            for (sf::Uint32 c = 32; c < 127; c++)
+            {
+                font.getGlyph(c, sizes[i] * scale + 0.5f, false);
+            }
+        }
+    }
+};
+
+// Copies of everything View reads, taken by the logic thread after it advanced and drawn by the
+// render thread without touching the live engine
+class RenderSnapshot
+{
+public:
+    Grid grid;
+    Tetromino tetromino;
+    PieceQueue queue;
+    GameState state;
+    SpecialEffects specialEffects;
+    unsigned hudVersion;   // bumped by every event that changes the score panel
+    unsigned boardVersion; // bumped by every event that changes locked cells
+
+    RenderSnapshot() : state(&grid, &tetromino, &queue, NULL, NULL, NULL), specialEffects(NULL), hudVersion(0), boardVersion(0) {}
+};
+
+// Rendering functions
+class View : public EventListener
+{
+public:
+    static const int tileSize = 32;
+    sf::Font *font;
+    sf::RenderWindow *window;
+    sf::RenderTarget *target; // NULL when rasterizing into the frame buffer
+    FrameBuffer *frame;
+    Grid *grid;
+    Tetromino *tetromino;
+    PieceQueue *queue;
+    GameState *state;
+    SpecialEffects *specialEffects;
+
+    // HUD strings, rebuilt only after an event that can change them
+    bool hudDirty;
+    std::string scoreString;
+    std::string highestScoreString;
+    std::string levelString;
+
+    // Preview column quads, rebuilt only when the queue moves
+    int previewCount;
+    sf::VertexArray previewVertices;
+    unsigned previewHead;
+    int previewBuiltCount;
+
+    // Everything is laid out in logical pixels, tileSize per cell; the window's sf::View scales that
+    // by a whole factor whenever the window is big enough, so cells stay crisp
+    float scale;                   // window pixels per logical pixel, 1 for the frame buffer
+    sf::VertexArray boardVertices; // background, then one quad per cell; placed on resize
+    bool boardDirty;               // cell colors need refreshing from the grid
+
+    // Window only: the CPU-blended effects layer over the playfield and its streaming texture
+    FrameBuffer effects;
+    sf::Texture effectsTexture;
+
+    // Window only: instrumentation lines drawn over the playfield, toggled with F3
+    bool overlayEnabled;
+    std::string overlay;
+
+    // Window only: the sprint or ultra clock and the split delta, changing every frame, so they are
+    // glyph quads from the font's atlas rewritten in place, where sf::Text would allocate each time
+    static const int clockChars = 12;
+    sf::VertexArray clockVertices;
+    sf::VertexArray deltaVertices;
+    char clockText[clockChars + 1];
+
+    // Versions of the last snapshot shown, when drawing snapshots instead of the live engine
+    unsigned shownHudVersion;
+    unsigned shownBoardVersion;
+
+    View(sf::Font *fontPtr, sf::RenderWindow *windowPtr, FrameBuffer *framePtr, Grid *gridPtr, Tetromino *tetrominoPtr, PieceQueue *queuePtr, GameState *statePtr, SpecialEffects *specialEffectsPtr)
+        : font(fontPtr), window(windowPtr), target(windowPtr), frame(framePtr), grid(gridPtr), tetromino(tetrominoPtr), queue(queuePtr), state(statePtr), specialEffects(specialEffectsPtr), hudDirty(1),
+          previewCount(5), previewVertices(sf::Quads), previewHead(0), previewBuiltCount(-1), scale(1), boardVertices(sf::Quads), boardDirty(1),
+          effects(windowPtr ? getEffectsWidth() : 0, windowPtr ? getWindowHeight() : 0), overlayEnabled(0),
+          clockVertices(sf::Quads, clockChars * 4), deltaVertices(sf::Quads, clockChars * 4), shownHudVersion(0), shownBoardVersion(0)
+    {
+        buildBoard();
+        if (window)
+        {
+            effectsTexture.create(effects.width, effects.height);
+        }
+    }
+
+    static bool changesHud(const GameEvent &event)
+    {
+        return event.type == GameEvent::GameStarted or event.type == GameEvent::LinesCleared or event.type == GameEvent::LevelUp or
+               event.type == GameEvent::ScoreChanged;
+    }
+
+    static bool changesBoard(const GameEvent &event)
+    {
+        return event.type == GameEvent::GameStarted or event.type == GameEvent::PieceLocked; // the only events after which the grid has changed
+    }
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            hudDirty = hudDirty or changesHud(events[i]);
+            boardDirty = boardDirty or changesBoard(events[i]);
+        }
+        if (boardDirty)
+        {
+            previewBuiltCount = -1; // a new game refills the queue from the same head
+        }
+    }
+
+    // Draws from this snapshot from now on; its versions stand in for the events a view on the
+    // render thread does not receive, including those of snapshots it never saw
+    void show(RenderSnapshot *snapshot)
+    {
+        grid = &snapshot->grid;
+        tetromino = &snapshot->tetromino;
+        queue = &snapshot->queue;
+        state = &snapshot->state;
+        specialEffects = &snapshot->specialEffects;
+        if (snapshot->hudVersion != shownHudVersion)
+        {
+            hudDirty = 1;
+            shownHudVersion = snapshot->hudVersion;
+        }
+        if (snapshot->boardVersion != shownBoardVersion)
+        {
+            boardDirty = 1;
+            previewBuiltCount = -1;
+            shownBoardVersion = snapshot->boardVersion;
+        }
+    }
+
+    // Letterboxes the layout in a window of this size, at the largest whole scale that fits, or
+    // shrunk to fit when the window is smaller than the layout
+    void resize(unsigned width, unsigned height)
+    {
+        float fit = std::min((float)width / getWindowWidth(), (float)height / getWindowHeight());
+        scale = fit >= 1 ? std::floor(fit) : fit;
+
+        float scaledWidth = getWindowWidth() * scale;
+        float scaledHeight = getWindowHeight() * scale;
+        sf::View camera(sf::FloatRect(0, 0, getWindowWidth(), getWindowHeight()));
+        camera.setViewport(sf::FloatRect(std::floor((width - scaledWidth) / 2) / width, std::floor((height - scaledHeight) / 2) / height, scaledWidth / width,
+                                         scaledHeight / height));
+        if (window)
+        {
+            window->setView(camera);
+        }
+
+        buildBoard();
+        previewBuiltCount = -1;
+    }
+
+    // Rounds a logical coordinate to the nearest window pixel, so edges stay sharp at fractional scales
+    float snap(float value)
+    {
+        return std::floor(value * scale + 0.5f) / scale;
+    }
+
+    void setQuad(sf::VertexArray &quads, int index, float x, float y, float width, float height, sf::Color color)
+    {
+        sf::Vertex *quad = &quads[index * 4];
+        float left = snap(x), top = snap(y), right = snap(x + width), bottom = snap(y + height);
+        quad[0] = sf::Vertex(sf::Vector2f(left, top), color);
+        quad[1] = sf::Vertex(sf::Vector2f(right, top), color);
+        quad[2] = sf::Vertex(sf::Vector2f(right, bottom), color);
+        quad[3] = sf::Vertex(sf::Vector2f(left, bottom), color);
+    }
+
+    void buildBoard()
+    {
+        boardVertices.resize(4 * (1 + Grid::rows * Grid::cols));
+        setQuad(boardVertices, 0, 0, 0, Grid::cols * tileSize + 1, Grid::rows * tileSize + 1, Colors::getColor(Colors::Blue));
+        for (int i = 0; i < Grid::rows; i++)
+        {
+            for (int j = 0; j < Grid::cols; j++)
+            {
+                setQuad(boardVertices, 1 + i * Grid::cols + j, j * tileSize + 1, i * tileSize + 1, tileSize - 1, tileSize - 1, Colors::getColor(Colors::Black));
+            }
+        }
+        boardDirty = 1;
+    }
+
+    void draw(const sf::Text &text)
+    {
+        if (target and scale != 1)
+        {
+            // Glyphs rasterized at window size and shrunk back by the view, instead of stretched bitmaps
+            sf::Text sharp = text;
+            sharp.setCharacterSize(text.getCharacterSize() * scale + 0.5f);
+            sharp.setScale(1 / scale, 1 / scale);
+            target->draw(sharp);
+        }
+        else if (target)
+        {
+            target->draw(text); // the frame buffer has no glyph rasterizer, text is window only
+        }
+    }
+
+    // Glyph quads laid out by setGlyphs at this character size
+    void drawGlyphs(const sf::VertexArray &quads, unsigned size)
+    {
+        if (target)
+        {
+            sf::RenderStates states(&font->getTexture(size * scale + 0.5f));
+            states.transform.scale(1 / scale, 1 / scale);
+            target->draw(quads, states);
+        }
+    }
+
+    // Lays out a line of text over the quads like sf::Text would, in window pixels so glyphs stay sharp
+    // at any scale; quads past the text are collapsed
+    void setGlyphs(sf::VertexArray &quads, const char *chars, float x, float y, unsigned size, sf::Color color)
+    {
+        unsigned pixelSize = size * scale + 0.5f;
+        float pen = x * scale;
+        float baseline = y * scale + pixelSize;
+        for (size_t q = 0; q < quads.getVertexCount() / 4; q++)
+        {
+            sf::Vertex *quad = &quads[q * 4];
+            if (!*chars)
+            {
+                for (int k = 0; k < 4; k++)
+                {
+                    quad[k].position = sf::Vector2f();
+                }
+                continue;
+            }
+            const sf::Glyph &glyph = font->getGlyph((unsigned char)*chars++, pixelSize, false);
+            float left = pen + glyph.bounds.left;
+            float top = baseline + glyph.bounds.top;
+            float right = left + glyph.bounds.width;
+            float bottom = top + glyph.bounds.height;
+            float u = glyph.textureRect.left;
+            float v = glyph.textureRect.top;
+            float w = glyph.textureRect.width;
+            float h = glyph.textureRect.height;
+            quad[0] = sf::Vertex(sf::Vector2f(left, top), color, sf::Vector2f(u, v));
+            quad[1] = sf::Vertex(sf::Vector2f(right, top), color, sf::Vector2f(u + w, v));
+            quad[2] = sf::Vertex(sf::Vector2f(right, bottom), color, sf::Vector2f(u + w, v + h));
+            quad[3] = sf::Vertex(sf::Vector2f(left, bottom), color, sf::Vector2f(u, v + h));
+            pen += glyph.advance;
+        }
+    }
+
+    // Game time as m:ss.cc, signed for deltas
+    static void formatTicks(char *text, size_t size, sf::Int64 ticks, int tickMicroseconds, bool sign)
+    {
+        sf::Int64 centiseconds = (ticks < 0 ? -ticks : ticks) * tickMicroseconds / 10000;
+        const char *prefix = !sign ? "" : ticks < 0 ? "-" : "+";
+        snprintf(text, size, "%s%d:%02d.%02d", prefix, (int)(centiseconds / 6000), (int)(centiseconds / 100 % 60), (int)(centiseconds % 100));
+    }
+
+    void draw(const sf::RectangleShape &shape, sf::Vector2f offset = sf::Vector2f())
+    {
+        if (target)
+        {
+            sf::RenderStates states;
+            states.transform.translate(offset);
+            target->draw(shape, states);
+        }
+        else
+        {
+            sf::Vector2f position = shape.getPosition();
+            sf::Vector2f size = shape.getSize();
+            frame->fillRect(position.x + offset.x, position.y + offset.y, size.x, size.y, shape.getFillColor());
+        }
+    }
+
+    void draw(const sf::VertexArray &quads, sf::Vector2f offset = sf::Vector2f())
+    {
+        if (target)
+        {
+            sf::RenderStates states;
+            states.transform.translate(offset);
+            target->draw(quads, states);
+        }
+        else
+        {
+            for (size_t i = 0; i + 3 < quads.getVertexCount(); i += 4)
+            {
+                sf::Vector2f position = quads[i].position;
+                sf::Vector2f corner = quads[i + 2].position;
+                frame->fillRect(position.x + offset.x, position.y + offset.y, corner.x - position.x, corner.y - position.y, quads[i].color);
+            }
+        }
+    }
+
+    // The playfield's shake offset, whole pixels
+    sf::Vector2f getShake()
+    {
+        int x, y;
+        specialEffects->getShakeOffset(x, y);
+        return sf::Vector2f(x, y);
+    }
+
+    // The playfield plus one tile, so flying blocks leaving on the right are not cut
+    static int getEffectsWidth()
+    {
+        return tileSize * (Grid::cols + 1) + 1;
+    }
+
+    static int getWindowWidth()
+    {
+        return tileSize * Grid::cols + 1 + (tileSize * 10); // score panel, then the preview column
+    }
+
+    static int getWindowHeight()
+    {
+        return tileSize * Grid::rows + 1;
+    }
+
+    void renderGameOver()
+    {
+        sf::Text text;
+        text.setFont(*font);
+        text.setString(state->splits.finishTicks ? "Finished" : "Game Over");
+        text.setCharacterSize(28);
+        text.setPosition(65, 250);
+        draw(text);
+    }
+
+    void renderPause()
+    {
+        sf::Text text;
+        text.setFont(*font);
+        text.setString("Paused");
+        text.setCharacterSize(32);
+        text.setPosition(90, 250);
+        draw(text);
+    }
+
+    void renderTitleScreen()
+    {
+        sf::Text text;
+        text.setFont(*font);
+        text.setString("Tetris");
+        text.setCharacterSize(55);
+        text.setPosition(199, 250);
+        draw(text);
+    }
+
+    void renderTetromino()
+    {
+        sf::RectangleShape tile;
+        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
+        tile.setFillColor(Colors::getColor(tetromino->colorId));
+        for (int i = 0; i < 4; i++)
+        {
+            tile.setPosition(tetromino->blocksCurrent[i].x * tileSize, tetromino->blocksCurrent[i].y * tileSize);
+            tile.move(1, 1);
+            draw(tile, getShake());
+        }
+    }
+
+    // Flying blocks over fading copies at their last few positions
+    void renderFlyingBlocks(FrameBuffer *canvas, sf::Vector2f offset)
+    {
+        for (std::vector<FxBlock>::iterator it = specialEffects->fxBlocks.begin(); it != specialEffects->fxBlocks.end(); ++it)
+        {
+            FxBlock *block = &*it;
+            for (int i = FxBlock::trailLength - 1; i >= 0; i--)
+            {
+                if (block->trailX[i] != block->x or block->trailY[i] != block->y)
+                {
+                    int alpha = 120 * (FxBlock::trailLength - i) / (FxBlock::trailLength + 1);
+                    canvas->fillRect(block->trailX[i] + offset.x, block->trailY[i] + offset.y, tileSize - 1, tileSize - 1, Colors::getColor(block->colorId, alpha));
+                }
+            }
+            canvas->fillRect(block->x + offset.x, block->y + offset.y, tileSize - 1, tileSize - 1, Colors::getColor(block->colorId, 200));
+        }
+    }
+
+    // Cleared rows light up white and fade
+    void renderFlashes(FrameBuffer *canvas, sf::Vector2f offset)
+    {
+        for (int r = 0; r < Grid::rows; r++)
+        {
+            if (specialEffects->flashTimers[r] > 0)
+            {
+                int alpha = 180 * specialEffects->flashTimers[r] / SpecialEffects::flashUpdates;
+                canvas->fillRect(1 + offset.x, r * tileSize + 1 + offset.y, Grid::cols * tileSize - 1, tileSize - 1, sf::Color(255, 255, 255, alpha));
+            }
+        }
+    }
+
+    // The ghost piece, flying blocks and flashes, blended on the CPU: straight into the frame buffer,
+    // or into a transparent layer that reaches the window as one texture upload per frame
+    void renderEffects()
+    {
+        sf::Vector2f shake = getShake();
+        FrameBuffer *canvas = target ? &effects : frame;
+        sf::Vector2f offset = target ? sf::Vector2f() : shake;
+        if (target)
+        {
+            effects.clearTransparent();
+        }
+
+        renderCurrentTetrominoShadow(canvas, offset);
+        renderFlyingBlocks(canvas, offset);
+        renderFlashes(canvas, offset);
+
+        if (target)
+        {
+            effectsTexture.update(&effects.pixels[0]);
+            sf::Sprite sprite(effectsTexture);
+            sprite.setPosition(shake);
+            target->draw(sprite, sf::RenderStates(sf::BlendMode(sf::BlendMode::One, sf::BlendMode::OneMinusSrcAlpha))); // premultiplied
+        }
+    }
+
+    void renderHeldTetromino()
+    {
+        sf::Text text;
+        text.setFont(*font);
+        text.setString("hold");
+        text.setCharacterSize(22);
+        text.setPosition((12 * tileSize), 32);
+        draw(text);
+
+        if (!state->heldPiece)
+        {
+            return;
+        }
+
+        Tetromino held = Generator::getTetromino(PieceQueue::getShapeId(state->heldPiece), PieceQueue::getColorId(state->heldPiece));
+        sf::RectangleShape tile;
+        tile.setSize(sf::Vector2f(tileSize - 1, tileSize - 1));
+        tile.setFillColor(Colors::getColor(held.colorId, state->holdUsed ? 120 : 255));
+        for (int i = 0; i < 4; i++)
+        {
+            tile.setPosition((held.blocksCurrent[i].x + 13 - held.boxSize / 2.0f) * tileSize, held.blocksCurrent[i].y * tileSize + (3 * tileSize));
+            tile.move(1, 1);
+            draw(tile);
+        }
+    }
+
+    // Upcoming pieces down the right column, three tiles apart, in one draw call
+    void renderPreview()
+    {
+        sf::Text text;
+        text.setFont(*font);
+        text.setString("next");
+        text.setCharacterSize(22);
+        text.setPosition((17 * tileSize), 32);
+        draw(text);
+
+        int count = std::max(0, std::min(previewCount, (int)PieceQueue::maxPreview));
+        if (queue->head != previewHead or count != previewBuiltCount)
+        {
+            previewVertices.resize(count * 16);
+            for (int p = 0; p < count; p++)
+            {
+                unsigned char piece = queue->peek(p);
+                Tetromino next = Generator::getTetromino(PieceQueue::getShapeId(piece), PieceQueue::getColorId(piece));
+                sf::Color color = Colors::getColor(next.colorId);
+                for (int i = 0; i < 4; i++)
+                {
+                    float x = (next.blocksCurrent[i].x + 18 - next.boxSize / 2.0f) * tileSize + 1;
+                    float y = (next.blocksCurrent[i].y + 2 + 3 * p) * tileSize + 1;
+                    setQuad(previewVertices, p * 4 + i, x, y, tileSize - 1, tileSize - 1, color);
+                }
+            }
+            previewHead = queue->head;
+            previewBuiltCount = count;
+        }
+        draw(previewVertices);
+    }
+
+    void renderCurrentTetrominoShadow(FrameBuffer *canvas, sf::Vector2f offset)
+    {
+        bool show = true;
+
+        if (state->shadowEnabled != 1)
+        {
+            show = false;
+        }
+        else
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                if (tetromino->blocksCurrent[i].y < 0)
+                {
+                    show = false;
+                    break;
+                }
+            }
+        }
+
+        if (show and tetromino->currentHardDropMaxDistance > 0)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                int x = tetromino->blocksCurrent[i].x * tileSize + 1;
+                int y = (tetromino->blocksCurrent[i].y + tetromino->currentHardDropMaxDistance) * tileSize + 1;
+                canvas->fillRect(x + offset.x, y + offset.y, tileSize - 1, tileSize - 1, Colors::getColor(Colors::Grey, 80));
+            }
+        }
+    }
+
+    void renderScore()
+    {
+        if (hudDirty)
+        {
+            scoreString = std::to_string(state->currentScore);
+            highestScoreString = std::to_string(state->highestScore);
+            levelString = std::to_string(state->difficultyLevel);
+            hudDirty = 0;
+        }
+
+        sf::Text text;
+        text.setFont(*font);
+
+        text.setString("score");
+        text.setCharacterSize(22);
+        text.setPosition(tileSize * 11 + 24, tileSize * 8 + 12);
+        draw(text);
+
+        text.setString(scoreString);
+        text.setCharacterSize(28);
+        text.setPosition(tileSize * 11 + 24, tileSize * 9 + 5);
+        draw(text);
+
+        // Timed modes show their clock where the highscore goes
+        Rules *rules = state->rules;
+        bool timed = rules and rules->mode != Rules::Marathon;
+        text.setString(!timed ? "high" : rules->mode == Rules::Ultra ? "left" : "time");
+        text.setCharacterSize(22);
+        text.setPosition(tileSize * 11 + 24, tileSize * 10 + 12);
+        draw(text);
+
+        if (timed)
+        {
+            renderClock();
+        }
+        else
+        {
+            text.setString(highestScoreString);
+            text.setCharacterSize(28);
+            text.setPosition(tileSize * 11 + 24, tileSize * 11 + 5);
+            draw(text);
+        }
+
+        text.setString("level");
+        text.setCharacterSize(20);
+        text.setPosition(tileSize * 11 + 24, tileSize * 13);
+        draw(text);
+
+        text.setString(levelString);
+        text.setCharacterSize(20);
+        text.setPosition(tileSize * 11 + 24, tileSize * 14);
+        draw(text);
+    }
+
+    // Elapsed time of a sprint or time left of an ultra, stopped at the finish, and the delta to the
+    // personal best's splits in green when ahead and red when behind
+    void renderClock()
+    {
+        Rules *rules = state->rules;
+        sf::Int64 ticks = state->splits.finishTicks ? state->splits.finishTicks : state->gameTicks;
+        if (rules->mode == Rules::Ultra)
+        {
+            ticks = std::max(rules->ultraTicks - ticks, (sf::Int64)0);
+        }
+        formatTicks(clockText, sizeof(clockText), ticks, rules->tickMicroseconds, 0);
+        setGlyphs(clockVertices, clockText, tileSize * 11 + 24, tileSize * 11 + 7, 20, sf::Color::White);
+        drawGlyphs(clockVertices, 20);
+
+        sf::Int64 delta;
+        if (state->getSplitDelta(delta))
+        {
+            formatTicks(clockText, sizeof(clockText), delta, rules->tickMicroseconds, 1);
+            setGlyphs(deltaVertices, clockText, tileSize * 11 + 24, tileSize * 12 + 4, 13, delta > 0 ? sf::Color(230, 70, 70) : sf::Color(80, 220, 100));
+            drawGlyphs(deltaVertices, 13);
+        }
+    }
+
+    // Background and cells in one draw call; colors are refreshed only after the grid changed
+    void renderGrid()
+    {
+        if (boardDirty)
+        {
+            for (int i = 0; i < grid->rows; i++)
+            {
+                for (int j = 0; j < grid->cols; j++)
+                {
+                    int value = grid->getValue(j, i);
+                    sf::Color color = Colors::getColor(value > 0 ? value : (int)Colors::Black);
+                    sf::Vertex *quad = &boardVertices[(1 + i * grid->cols + j) * 4];
+                    for (int k = 0; k < 4; k++)
+                    {
+                        quad[k].color = color;
+                    }
+                }
+            }
+            boardDirty = 0;
+        }
+        draw(boardVertices, getShake());
+    }
+
+    void renderHelp()
+    {
+        int offsetY = 478;
+        int offsetX = 345;
+        sf::Text text;
+        text.setFont(*font);
+        text.setCharacterSize(13);
+        text.setString("up       - rotate");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+        offsetY += 22;
+        text.setString("down   - soft drop");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+        offsetY += 22;
+        text.setString("space - hard drop");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+        offsetY += 22;
+        text.setString("c        - hold");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+        offsetY += 32;
+        text.setString("p - pause");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+        offsetY += 22;
+        text.setString("q - quit");
+        text.setPosition(offsetX, offsetY);
+        draw(text);
+    }
+
+    void render()
+    {
+        if (target)
+        {
+            target->clear(sf::Color::Black);
+        }
+        else
+        {
+            frame->clear(sf::Color::Black);
+        }
+
+        if (state->currentState == GameState::Title)
+        {
+            renderTitleScreen();
+        }
+        else
+        {
+            renderGrid();
+            renderHeldTetromino();
+            renderPreview();
+            renderScore();
+            renderTetromino();
+            renderHelp();
+            renderEffects();
+
+            if (state->currentState == GameState::Pause)
+            {
+                renderPause();
+            }
+            else if (state->currentState == GameState::GameOver)
+            {
+                renderGameOver();
+            }
+        }
+
+        renderOverlay();
+    }
+
+    void renderOverlay()
+    {
+        if (!overlayEnabled or overlay.empty())
+        {
+            return;
+        }
+
+        sf::RectangleShape background(sf::Vector2f(Grid::cols * tileSize - 1, 3 * 17 + 8));
+        background.setPosition(1, 1);
+        background.setFillColor(sf::Color(0, 0, 0, 170));
+        draw(background);
+
+        sf::Text text;
+        text.setFont(*font);
+        text.setCharacterSize(13);
+        text.setString(overlay);
+        text.setPosition(6, 4);
+        draw(text);
+    }
+
+    // Shows the rendered frame; separate from render() so the caller can time the two
+    void present()
+    {
+        if (window)
+        {
+            window->display();
+        }
+    }
+};
+
+// Game logic goes here
+class Logic
+{
+public:
+    Grid *grid;
+    Input *input;
+    Tetromino *tetromino;
+    GameState *state;
+    SpecialEffects *specialEffects;
+    Random *random;
+    EventBus *events;
+    Replay *recorder; // receives every consumed event when recording
+
+    static const int tickMicroseconds = 1000;       // fixed logic step
+    static const int maxCatchUpMicroseconds = 250000; // stalls longer than this are skipped
+
+    Rules *rules;
+    int gravityTimer; // fraction of a cell fallen so far, in 1/Rules::gravityOne
+    int effectsTimer; // microseconds of play not yet passed on to the effects
+    bool softDropHeld;
+    sf::Int64 simulatedTime;
+    sf::Int64 tickCount; // ticks actually simulated, the time base of replays
+
+    // Delayed auto-shift: a held direction starts repeating after dasMicroseconds,
+    // then moves every arrMicroseconds (0 slides to the wall within the same tick)
+    int dasMicroseconds;
+    int arrMicroseconds;
+    bool leftHeld;
+    bool rightHeld;
+    int heldDirection;
+    int dasTimer;
+    int arrTimer;
+
+    // Lock delay: a grounded piece locks once lockTimer reaches Rules::lockDelayMicroseconds;
+    // moves and rotations restart it until lockResets runs out, reaching a new lowest row refills them
+    int lockTimer;
+    int lockResets;
+    int lowestRow;
+
+    // Keys used on the current piece, for finesse statistics
+    int pieceInputs;
+    int spawnMinX;
+
+    Logic(Grid *gridPtr, Input *inputPtr, Tetromino *tetrominoPtr, GameState *statePtr, SpecialEffects *specialEffectsPtr, Random *randomPtr, EventBus *eventsPtr, Rules *rulesPtr)
+        : grid(gridPtr), input(inputPtr), tetromino(tetrominoPtr), state(statePtr), specialEffects(specialEffectsPtr), random(randomPtr), events(eventsPtr), recorder(NULL), rules(rulesPtr)
+    {
+        gravityTimer = 0;
+        effectsTimer = 0;
+        softDropHeld = 0;
+        simulatedTime = 0;
+        tickCount = 0;
+        dasMicroseconds = 167000;
+        arrMicroseconds = 33000;
+        leftHeld = 0;
+        rightHeld = 0;
+        heldDirection = 0;
+        dasTimer = 0;
+        arrTimer = 0;
+        lockTimer = 0;
+        lockResets = 0;
+        lowestRow = 0;
+        pieceInputs = 0;
+        spawnMinX = 0;
+    }
+
+    // Runs fixed ticks up to the given time, applying each queued event in the tick it happened
+    void update(sf::Int64 now)
+    {
+        if (now - simulatedTime > maxCatchUpMicroseconds)
+        {
+            simulatedTime = now - maxCatchUpMicroseconds;
+        }
+
+        while (simulatedTime + tickMicroseconds <= now)
+        {
+            simulatedTime += tickMicroseconds;
+            tickCount++;
+            events->tick = tickCount;
+
+            InputEvent event;
+            while (input->events.peek(event) and event.time <= simulatedTime)
+            {
+                input->events.pop(event);
+                if (recorder)
+                {
+                    recorder->add(tickCount, event.type);
+                }
+                handleInput(event);
+            }
+
+            tick();
+            updateAutoShift(tickMicroseconds);
+            events->dispatch();
+        }
+    }
+
+    void handleInput(const InputEvent &event)
+    {
+        if (event.type == InputEvent::SoftDropPressed)
+        {
+            softDropHeld = 1;
+            return;
+        }
+
+        if (event.type == InputEvent::SoftDropReleased)
+        {
+            softDropHeld = 0;
+            return;
+        }
+
+        if (event.type == InputEvent::MoveLeftReleased or event.type == InputEvent::MoveRightReleased)
+        {
+            releaseDirection(event.type == InputEvent::MoveLeftReleased ? -1 : 1);
+            return;
+        }
+
+        if (event.type == InputEvent::MoveLeft or event.type == InputEvent::MoveRight)
+        {
+            pressDirection(event.type == InputEvent::MoveLeft ? -1 : 1);
+        }
+
+        if (state->handleInput(event))
+        {
+            if (event.type == InputEvent::HardDrop or event.type == InputEvent::NextPuzzle or event.type == InputEvent::RestartPuzzle)
+            {
+                startedGame();
+            }
+            return;
+        }
+
+        if (state->currentState != GameState::Playing)
+        {
+            return;
+        }
+
+        switch (event.type)
+        {
+        // MOVE LEFT OR RIGHT
+        case InputEvent::MoveLeft:
+        case InputEvent::MoveRight:
+
+            pieceInputs++;
+            tryMoveX(event.type == InputEvent::MoveLeft ? -1 : 1);
+            break;
+
+        // ROTATE
+        case InputEvent::Rotate:
+        case InputEvent::RotateCounterClockwise:
+
+            pieceInputs++;
+            if (tryRotate(event.type == InputEvent::Rotate ? 1 : -1))
+            {
+                resetLockDelay();
+                events->publish(GameEvent::PieceRotated);
+            }
+
+            tetromino->currentHardDropMaxDistance = getDropDistance();
+            break;
+
+        // HOLD
+        case InputEvent::Hold:
+
+            if (state->holdTetromino())
+            {
+                gravityTimer = 0;
+                if (!isCurrentPositionValid())
+                {
+                    endGame(); // block out
+                    return;
+                }
+                resetPieceCounters();
+            }
+            break;
+
+        // HARD DROP
+        case InputEvent::HardDrop:
+
+            doHardDrop();
+            lockTetromino();
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // SRS: the first of up to five kicked positions that fits wins, each one tested with a few row mask ANDs
+    bool tryRotate(int direction)
+    {
+        Tetromino rotated = *tetromino;
+        rotated.rotate(direction);
+
+        unsigned masks[4];
+        rotated.getRowMasks(masks);
+        Block box = rotated.getBox();
+        const int(*kicks)[2] = getKicks(tetromino->shapeId, tetromino->orientation, direction);
+
+        for (int k = 0; k < 5; k++)
+        {
+            int dx = kicks[k][0];
+            int dy = -kicks[k][1]; // tables are y-up, the grid is y-down
+            if (!grid->collides(masks, box.x + dx, box.y + dy))
+            {
+                rotated.moveX(dx);
+                rotated.moveDown(dy);
+                *tetromino = rotated;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Kick offsets (x right, y up) for leaving `orientation` in `direction`
+    static const int (*getKicks(int shapeId, int orientation, int direction))[2]
+    {
+        static const int none[5][2] = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
+
+        // [from][clockwise, counterclockwise]
+        static const int common[4][2][5][2] = {
+            {{{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}, {{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}}},
+            {{{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}}, {{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}}},
+            {{{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}}, {{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}},
+            {{{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}}, {{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}}}};
+
+        static const int longBar[4][2][5][2] = {
+            {{{0, 0}, {-2, 0}, {1, 0}, {-2, -1}, {1, 2}}, {{0, 0}, {-1, 0}, {2, 0}, {-1, 2}, {2, -1}}},
+            {{{0, 0}, {-1, 0}, {2, 0}, {-1, 2}, {2, -1}}, {{0, 0}, {2, 0}, {-1, 0}, {2, 1}, {-1, -2}}},
+            {{{0, 0}, {2, 0}, {-1, 0}, {2, 1}, {-1, -2}}, {{0, 0}, {1, 0}, {-2, 0}, {1, -2}, {-2, 1}}},
+            {{{0, 0}, {1, 0}, {-2, 0}, {1, -2}, {-2, 1}}, {{0, 0}, {-2, 0}, {1, 0}, {-2, -1}, {1, 2}}}};
+
+        int turn = direction > 0 ? 0 : 1;
+        if (shapeId == Tetromino::Shape_O)
+        {
+            return none;
+        }
+        if (shapeId == Tetromino::Shape_I)
+        {
+            return longBar[orientation & 3][turn];
+        }
+        return common[orientation & 3][turn];
+    }
+
+    bool tryMoveX(int dx)
+    {
+        tetromino->moveX(dx);
+
+        bool moved = isCurrentPositionValid();
+        if (!moved)
+        {
+            tetromino->restorePreviousPosition();
+        }
+        else
+        {
+            resetLockDelay();
+        }
+
+        tetromino->currentHardDropMaxDistance = getDropDistance();
+        return moved;
+    }
+
+    void pressDirection(int direction)
+    {
+        if (direction < 0)
+        {
+            leftHeld = 1;
+        }
+        else
+        {
+            rightHeld = 1;
+        }
+        heldDirection = direction;
+        dasTimer = 0;
+        arrTimer = 0;
+    }
+
+    void releaseDirection(int direction)
+    {
+        if (direction < 0)
+        {
+            leftHeld = 0;
+        }
+        else
+        {
+            rightHeld = 0;
+        }
+
+        if (heldDirection == direction)
+        {
+            // Fall back to the opposite key if it is still held, charging DAS anew
+            heldDirection = leftHeld ? -1 : (rightHeld ? 1 : 0);
+            dasTimer = 0;
+            arrTimer = 0;
+        }
+    }
+
+    void updateAutoShift(int elapsedMicroseconds)
+    {
+        if (heldDirection == 0 or state->currentState != GameState::Playing)
+        {
+            return;
+        }
+
+        if (dasTimer < dasMicroseconds)
+        {
+            dasTimer += elapsedMicroseconds;
+            if (dasTimer < dasMicroseconds)
+            {
+                return;
+            }
+            arrTimer = arrMicroseconds; // first repeat happens as soon as DAS is charged
+        }
+        else
+        {
+            arrTimer += elapsedMicroseconds;
+        }
+
+        if (arrMicroseconds <= 0)
+        {
+            while (tryMoveX(heldDirection))
+            {
+            }
+            return;
+        }
+
+        while (arrTimer >= arrMicroseconds)
+        {
+            arrTimer -= arrMicroseconds;
+            if (!tryMoveX(heldDirection))
+            {
+                arrTimer = 0;
+                break;
+            }
+        }
+    }
+
+    void tick()
+    {
+        if (state->currentState == GameState::Playing)
+        {
+            // GAME CLOCK
+            state->gameTicks++;
+            if (rules->mode == Rules::Ultra and state->gameTicks >= rules->ultraTicks)
+            {
+                finishGame(); // time is up
+                return;
+            }
+
+            // FREE DROP AND SOFT DROP
+            gravityTimer += rules->getGravity(state->difficultyLevel, softDropHeld);
+
+            int cells = gravityTimer / Rules::gravityOne;
+            if (cells > 0)
+            {
+                gravityTimer %= Rules::gravityOne;
+
+                // Fall straight to the computed distance, high gravity moves several rows at once
+                int distance = std::min(cells, getDropDistance());
+                if (distance > 0)
+                {
+                    tetromino->moveDown(distance);
+                    if (softDropHeld)
+                    {
+                        state->addScore(distance * rules->softDropPoints);
+                    }
+                    updateLowestRow();
+                    tetromino->currentHardDropMaxDistance = getDropDistance();
+                }
+            }
+
+            // LOCK DELAY
+            if (isPositionAfterNextDropValid())
+            {
+                lockTimer = 0;
+            }
+            else
+            {
+                lockTimer += tickMicroseconds;
+                if (lockTimer >= rules->lockDelayMicroseconds or lockResets >= rules->maxLockResets)
+                {
+                    lockTetromino();
+                    if (state->currentState != GameState::Playing)
+                    {
+                        return; // break the update loop
+                    }
+                }
+            }
+
+            // SPECIAL EFFECTS
+            effectsTimer += tickMicroseconds;
+            while (effectsTimer >= SpecialEffects::updateMicroseconds)
+            {
+                specialEffects->updateFxBlocks();
+                effectsTimer -= SpecialEffects::updateMicroseconds;
+            }
+
+            specialEffects->removeFxBlocks();
+        }
+    }
+
+    void doHardDrop()
+    {
+        int distance = getDropDistance();
+        tetromino->moveDown(distance);
+        state->addScore(distance * rules->hardDropPoints);
+    }
+
+    // Rows the piece can fall, found per column instead of testing every offset; works above the board too
+    int getDropDistance()
+    {
+        int distance = INT_MAX; // a piece kicked above the hidden rows can fall further than rows
+        for (int i = 0; i < 4; i++)
+        {
+            int x = tetromino->blocksCurrent[i].x;
+            int y = tetromino->blocksCurrent[i].y;
+            int floor = std::max(y + 1, -grid->bufferRows);
+            while (floor < grid->rows and !grid->getRow(floor)[x])
+            {
+                floor++;
+            }
+            distance = std::min(distance, floor - y - 1);
+        }
+        return std::max(distance, 0);
+    }
+
+    int getLowestYoffset()
+    {
+        int lowestY = -10;
+        for (int i = 0; i < 4; i++)
+        {
+            if (tetromino->blocksCurrent[i].y > lowestY)
+            {
+                lowestY = tetromino->blocksCurrent[i].y;
+            }
+        }
+        return lowestY;
+    }
+
+    // Restarts the lock timer after a successful move or rotation, a limited number of times
+    void resetLockDelay()
+    {
+        updateLowestRow();
+        if (lockTimer > 0 and lockResets < rules->maxLockResets)
+        {
+            lockTimer = 0;
+            lockResets++;
+        }
+    }
+
+    void updateLowestRow()
+    {
+        int bottom = getLowestYoffset();
+        if (bottom > lowestRow)
+        {
+            lowestRow = bottom;
+            lockResets = 0;
+        }
+    }
+
+    // A new game has just spawned its first piece, possibly into a puzzle's stack
+    void startedGame()
+    {
+        resetPieceCounters();
+        if (!isCurrentPositionValid())
+        {
+            endGame(); // block out
+        }
+    }
+
+    // A timed mode's goal was reached: the run counts for the personal best
+    void finishGame()
+    {
+        state->finishRun();
+        endGame();
+    }
+
+    void endGame()
+    {
+        state->currentState = GameState::GameOver;
+        state->saveHighScore();
+        events->publish(GameEvent::GameEnded, state->currentScore);
+    }
+
+    // Lock out: a piece resting entirely in the hidden rows, or above them, ends the game
+    bool isLockedOut()
+    {
+        bool visible = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (tetromino->blocksCurrent[i].y < -grid->bufferRows)
+            {
+                return 1;
+            }
+            visible = visible or tetromino->blocksCurrent[i].y >= 0;
+        }
+        return !visible;
+    }
+
+    void lockTetromino()
+    {
+        if (isLockedOut())
+        {
+            endGame();
+            return;
+        }
+
+        placeTetrominoHere();
+        int cleared = clearFullRows();
+        GameEvent &locked = events->publish(GameEvent::PieceLocked, cleared);
+        locked.inputs = pieceInputs;
+        locked.minimumInputs = getMinimumInputs();
+        if (cleared)
+        {
+            events->publish(GameEvent::LinesCleared, cleared);
+        }
+        state->addLines(cleared);
+        if (rules->mode == Rules::Sprint and state->linesCleared >= rules->sprintLines)
+        {
+            finishGame();
+            return;
+        }
+        if (state->puzzles and cleared and grid->isEmpty())
+        {
+            state->nextPuzzle(); // a perfect clear solves the puzzle
+            startedGame();
+            return;
+        }
+        if (!generateNewTetromino())
+        {
+            endGame(); // block out: no column left for the new piece
+        }
+    }
+
+    // Estimate of the fewest keys reaching the current spot: one rotation either way or two for
+    // the reversed state, and a long shift can be one DAS to the wall followed by taps back
+    int getMinimumInputs()
+    {
+        int rotations = tetromino->orientation == 2 ? 2 : tetromino->orientation % 2;
+        if (tetromino->shapeId == Tetromino::Shape_O)
+        {
+            rotations = 0;
+        }
+        else if (tetromino->shapeId == Tetromino::Shape_I or tetromino->shapeId == Tetromino::Shape_S or tetromino->shapeId == Tetromino::Shape_Z)
+        {
+            rotations = tetromino->orientation % 2;
+        }
+
+        int minX = grid->cols, maxX = -1;
+        for (int i = 0; i < 4; i++)
+        {
+            minX = std::min(minX, tetromino->blocksCurrent[i].x);
+            maxX = std::max(maxX, tetromino->blocksCurrent[i].x);
+        }
+
+        int dx = minX - spawnMinX;
+        int moves = abs(dx);
+        if (dx < 0)
+        {
+            moves = std::min(moves, 1 + minX);
+        }
+        else if (dx > 0)
+        {
+            moves = std::min(moves, 1 + (grid->cols - 1 - maxX));
+        }
+
+        return rotations + moves;
+    }
+
+    // Lock out and the validity checks keep every cell on the board; should one slip past them it is
+    // dropped rather than written outside the grid
+    void placeTetrominoHere()
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            Block cell = tetromino->blocksCurrent[i];
+            if (grid->isInside(cell.x, cell.y))
+            {
+                grid->getRow(cell.y)[cell.x] = tetromino->colorId;
+                grid->updateRowMask(cell.y);
+            }
+        }
+    }
+
+    bool isRowFull(int r)
+    {
+        return grid->getRowMask(r) == ~0u; // every column set on top of the walls
+    }
+
+    void moveRowDown(int r, int num)
+    {
+        int *from = grid->getRow(r);
+        int *to = grid->getRow(r + num);
+        for (int c = 0; c < grid->cols; c++)
+        {
+            to[c] = from[c];
+            from[c] = 0;
+        }
+        grid->updateRowMask(r + num);
+        grid->updateRowMask(r);
+    }
+
+    void clearRow(int r)
+    {
+        GameEvent &event = events->publish(GameEvent::RowCleared, r);
+        int *row = grid->getRow(r);
+        for (int c = 0; c < grid->cols; c++)
+        {
+            event.colors[c] = row[c];
+            row[c] = 0;
+        }
+        grid->updateRowMask(r);
+    }
+
+    // Hidden rows take part too, so blocks stacked above the board come down into view
+    int clearFullRows()
+    {
+        int cleared = 0;
+        for (int r = grid->rows - 1; r >= -grid->bufferRows; r--)
+        {
+            if (isRowFull(r))
+            {
+                clearRow(r);
+                cleared++;
+            }
+            else if (cleared > 0)
+            {
+                moveRowDown(r, cleared);
+            }
+        }
+        return cleared;
+    }
+
+    bool generateNewTetromino()
+    {
+        bool spawned = state->generateNewTetromino();
+        resetPieceCounters();
+        return spawned;
+    }
+
+    void resetPieceCounters()
+    {
+        lockTimer = 0;
+        lockResets = 0;
+        lowestRow = getLowestYoffset();
+        tetromino->currentHardDropMaxDistance = getDropDistance();
+        pieceInputs = 0;
+        spawnMinX = grid->cols;
+        for (int i = 0; i < 4; i++)
+        {
+            spawnMinX = std::min(spawnMinX, tetromino->blocksCurrent[i].x);
+        }
+    }
+
+    bool isCurrentPositionValid(int offsetY = 0)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (tetromino->blocksCurrent[i].x < 0)
+            {
+                return 0;
+            }
+
+            if (tetromino->blocksCurrent[i].x >= grid->cols)
+            {
+                return 0;
+            }
+
+            if (tetromino->blocksCurrent[i].y + offsetY >= grid->rows)
+            {
+                return 0;
+            }
+
+            if (tetromino->blocksCurrent[i].y + offsetY >= -grid->bufferRows and grid->getValue(tetromino->blocksCurrent[i].x, tetromino->blocksCurrent[i].y + offsetY))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    bool isPositionAfterNextDropValid()
+    {
+        return isCurrentPositionValid(1);
+    }
+};
+
+// Everything that decides how a game continues, packed into plain bytes: copying one is a single
+// memcpy, so it serves rollback, save files and branching searches. Effects and pending input are left out
+class Snapshot
+{
+public:
+    static const int cellCount = (Grid::bufferRows + Grid::rows) * Grid::cols;
+
+    unsigned char cells[cellCount / 2]; // color ids, 4 bits per cell, hidden rows first
+    unsigned char pieces[PieceQueue::capacity];
+    unsigned queueHead, queueTail;
+    unsigned randomState;
+    int currentScore, highestScore;
+    int linesCleared;
+    sf::Int64 simulatedTime, tickCount;
+    sf::Int64 gameTicks;
+    Splits splits;
+    int gravityTimer, lockTimer, dasTimer, arrTimer;
+    int effectsTimer;
+    short combo;
+    signed char boxX, boxY;
+    unsigned char shapeId, colorId, orientation;
+    unsigned char currentState, difficultyLevel, heldPiece, holdUsed, lastColorId;
+    signed char shadowEnabled, heldDirection, lowestRow, spawnMinX;
+    unsigned char lockResets, pieceInputs, softDropHeld, leftHeld, rightHeld;
+
+    int getCell(int i) const
+    {
+        return cells[i >> 1] >> ((i & 1) * 4) & 15;
+    }
+
+    void setCell(int i, int colorId)
+    {
+        unsigned char &pair = cells[i >> 1];
+        pair = (pair & ~(15 << ((i & 1) * 4))) | (colorId & 15) << ((i & 1) * 4);
+    }
+};
+
+// Headless game: board, pieces, rules and effects without a window
+class Engine
+{
+public:
+    Random random;
+    Random effectsRandom; // flying blocks draw from their own stream so a snapshot can leave them out
+    Rules rules;
+    Grid grid;
+    Tetromino tetromino;
+    PieceQueue queue;
+    GameState state;
+    SpecialEffects specialEffects;
+    EventBus events;
+    Input input;
+    Logic logic;
+
+    Engine(unsigned seed) : random(seed),
+                            effectsRandom(seed ^ 0x5F3759DF),
+                            queue(&random),
+                            state(&grid, &tetromino, &queue, &random, &events, &rules),
+                            specialEffects(&effectsRandom),
+                            logic(&grid, &input, &tetromino, &state, &specialEffects, &random, &events, &rules)
+    {
+        queue.reset();
+        events.subscribe(&specialEffects);
+    }
+
+    void capture(Snapshot &snapshot)
+    {
+        memset(&snapshot, 0, sizeof(snapshot));
+        for (int y = -Grid::bufferRows, i = 0; y < Grid::rows; y++)
+        {
+            int *row = grid.getRow(y);
+            for (int x = 0; x < Grid::cols; x++, i++)
+            {
+                snapshot.setCell(i, row[x]);
+            }
+        }
+
+        memcpy(snapshot.pieces, queue.pieces, sizeof(snapshot.pieces));
+        snapshot.queueHead = queue.head;
+        snapshot.queueTail = queue.tail;
+        snapshot.lastColorId = queue.lastColorId < 0 ? 0 : queue.lastColorId;
+        snapshot.randomState = random.state;
+
+        Block box = tetromino.getBox();
+        snapshot.boxX = box.x;
+        snapshot.boxY = box.y;
+        snapshot.shapeId = tetromino.shapeId;
+        snapshot.colorId = tetromino.colorId;
+        snapshot.orientation = tetromino.orientation;
+
+        snapshot.currentState = state.currentState;
+        snapshot.difficultyLevel = state.difficultyLevel;
+        snapshot.linesCleared = state.linesCleared;
+        snapshot.combo = state.combo;
+        snapshot.gameTicks = state.gameTicks;
+        snapshot.splits = state.splits;
+        snapshot.shadowEnabled = state.shadowEnabled;
+        snapshot.currentScore = state.currentScore;
+        snapshot.highestScore = state.highestScore;
+        snapshot.heldPiece = state.heldPiece;
+        snapshot.holdUsed = state.holdUsed;
+
+        snapshot.simulatedTime = logic.simulatedTime;
+        snapshot.tickCount = logic.tickCount;
+        snapshot.gravityTimer = logic.gravityTimer;
+        snapshot.lockTimer = logic.lockTimer;
+        snapshot.lockResets = logic.lockResets;
+        snapshot.lowestRow = logic.lowestRow;
+        snapshot.dasTimer = logic.dasTimer;
+        snapshot.arrTimer = logic.arrTimer;
+        snapshot.effectsTimer = logic.effectsTimer;
+        snapshot.heldDirection = logic.heldDirection;
+        snapshot.softDropHeld = logic.softDropHeld;
+        snapshot.leftHeld = logic.leftHeld;
+        snapshot.rightHeld = logic.rightHeld;
+        snapshot.pieceInputs = std::min(logic.pieceInputs, 255);
+        snapshot.spawnMinX = logic.spawnMinX;
+    }
+
+    // Flying blocks are dropped, they do not feed back into the game
+    void restore(const Snapshot &snapshot)
+    {
+        for (int y = -Grid::bufferRows, i = 0; y < Grid::rows; y++)
+        {
+            int *row = grid.getRow(y);
+            for (int x = 0; x < Grid::cols; x++, i++)
+            {
+                row[x] = snapshot.getCell(i);
+            }
+            grid.updateRowMask(y);
+        }
+
+        memcpy(queue.pieces, snapshot.pieces, sizeof(queue.pieces));
+        queue.head = snapshot.queueHead;
+        queue.tail = snapshot.queueTail;
+        queue.lastColorId = snapshot.lastColorId ? snapshot.lastColorId : -1;
+        random.state = snapshot.randomState;
+
+        if (snapshot.shapeId)
+        {
+            tetromino = Generator::getTetromino(snapshot.shapeId, snapshot.colorId);
+            tetromino.place(Block(snapshot.boxX, snapshot.boxY), snapshot.orientation);
+        }
+        else
+        {
+            tetromino = Tetromino();
+        }
+
+        state.currentState = snapshot.currentState;
+        state.difficultyLevel = snapshot.difficultyLevel;
+        state.linesCleared = snapshot.linesCleared;
+        state.combo = snapshot.combo;
+        state.gameTicks = snapshot.gameTicks;
+        state.splits = snapshot.splits;
+        if (state.getBestFilename())
+        {
+            state.bestSplits.load(state.getBestFilename()); // the best is not part of a snapshot
+        }
+        state.shadowEnabled = snapshot.shadowEnabled;
+        state.currentScore = snapshot.currentScore;
+        state.highestScore = snapshot.highestScore;
+        state.heldPiece = snapshot.heldPiece;
+        state.holdUsed = snapshot.holdUsed;
+
+        logic.simulatedTime = snapshot.simulatedTime;
+        logic.tickCount = snapshot.tickCount;
+        logic.gravityTimer = snapshot.gravityTimer;
+        logic.lockTimer = snapshot.lockTimer;
+        logic.lockResets = snapshot.lockResets;
+        logic.lowestRow = snapshot.lowestRow;
+        logic.dasTimer = snapshot.dasTimer;
+        logic.arrTimer = snapshot.arrTimer;
+        logic.effectsTimer = snapshot.effectsTimer;
+        logic.heldDirection = snapshot.heldDirection;
+        logic.softDropHeld = snapshot.softDropHeld;
+        logic.leftHeld = snapshot.leftHeld;
+        logic.rightHeld = snapshot.rightHeld;
+        logic.pieceInputs = snapshot.pieceInputs;
+        logic.spawnMinX = snapshot.spawnMinX;
+        if (snapshot.shapeId)
+        {
+            tetromino.currentHardDropMaxDistance = logic.getDropDistance();
+        }
+
+        specialEffects.clear();
+    }
+};
+
+// Memory-mapped checkpoint file: a header and one snapshot, saving is a memcpy into the mapping
+class SaveFile
+{
+public:
+    static const unsigned magic = 0x53525454; // "TTRS"
+    static const unsigned version = 3;        // bump whenever Snapshot changes
+
+    struct Header
+    {
+        unsigned magic;
+        unsigned version;
+        unsigned size;
+        unsigned checksum;
+    };
+
+    int fd;
+    char *data;
+
+    SaveFile() : fd(-1), data(NULL) {}
+
+    ~SaveFile()
+    {
+        close();
+    }
+
+    static size_t getFileSize()
+    {
+        return sizeof(Header) + sizeof(Snapshot);
+    }
+
+    bool open(const char *filename)
+    {
+        fd = ::open(filename, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 or ftruncate(fd, getFileSize()) != 0)
+        {
+            close();
+            return 0;
+        }
+        void *mapping = mmap(NULL, getFileSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close();
+            return 0;
+        }
+        data = (char *)mapping;
+        return 1;
+    }
+
+    void close()
+    {
+        if (data)
+        {
+            munmap(data, getFileSize());
+            data = NULL;
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    Header *getHeader()
+    {
+        return (Header *)data;
+    }
+
+    Snapshot *getSnapshot()
+    {
+        return (Snapshot *)(data + sizeof(Header));
+    }
+
+    // FNV-1a over the snapshot bytes
+    static unsigned getChecksum(const Snapshot *snapshot)
+    {
+        const unsigned char *bytes = (const unsigned char *)snapshot;
+        unsigned hash = 2166136261u;
+        for (size_t i = 0; i < sizeof(Snapshot); i++)
+        {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Fails on an empty, stale (other version or size) or torn file
+    bool load(Snapshot &snapshot)
+    {
+        if (!data)
+        {
+            return 0;
+        }
+        Header *header = getHeader();
+        if (header->magic != magic or header->version != version or header->size != sizeof(Snapshot) or header->checksum != getChecksum(getSnapshot()))
+        {
+            return 0;
+        }
+        memcpy(&snapshot, getSnapshot(), sizeof(Snapshot));
+        return 1;
+    }
+
+    // The checksum goes last, so a write cut short leaves a file that load() rejects
+    void store(const Snapshot &snapshot)
+    {
+        if (!data)
+        {
+            return;
+        }
+        Header *header = getHeader();
+        header->magic = magic;
+        header->version = version;
+        header->size = sizeof(Snapshot);
+        memcpy(getSnapshot(), &snapshot, sizeof(Snapshot));
+        header->checksum = getChecksum(getSnapshot());
+    }
+
+    void clear()
+    {
+        if (data)
+        {
+            getHeader()->magic = 0;
+        }
+    }
+};
+
+// Keeps the save file in step with the game: written on every lock, emptied when the game ends
+class Checkpoint : public EventListener
+{
+public:
+    Engine *engine;
+    SaveFile *saveFile;
+    Snapshot snapshot;
+
+    Checkpoint(Engine *enginePtr, SaveFile *saveFilePtr) : engine(enginePtr), saveFile(saveFilePtr) {}
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].type == GameEvent::PieceLocked or events[i].type == GameEvent::GameStarted)
+            {
+                save();
+            }
+            else if (events[i].type == GameEvent::GameEnded)
+            {
+                saveFile->clear();
+            }
+        }
+    }
+
+    void save()
+    {
+        int current = engine->state.currentState;
+        if (current == GameState::Playing or current == GameState::Pause)
+        {
+            engine->capture(snapshot);
+            saveFile->store(snapshot);
+        }
+        else
+        {
+            saveFile->clear();
+        }
+    }
+
+    // Continues a saved game paused, with the clock rebased and no keys held
+    bool resume()
+    {
+        if (!saveFile->load(snapshot))
+        {
+            return 0;
+        }
+        engine->restore(snapshot);
+        engine->state.currentState = GameState::Pause;
+        engine->logic.simulatedTime = 0;
+        engine->logic.softDropHeld = 0;
+        engine->logic.leftHeld = 0;
+        engine->logic.rightHeld = 0;
+        engine->logic.heldDirection = 0;
+        return 1;
+    }
+};
+
+// One fixed-stride training record, laid out exactly as TrainingShard's numpy dtype says
+class Transition
+{
+public:
+    unsigned short rows[Grid::rows]; // visible board before the action, column x in bit x
+    unsigned char piece;             // shape id 1-7 of the piece to place
+    unsigned char next;              // shape id of the piece after it
+    unsigned char action;            // orientation * Grid::cols + leftmost column the piece was dropped from
+    unsigned char done;              // the placement ended the game
+    int reward;                      // score gained by the placement
+};
+
+// Memory-mapped .npy file of Transition records, sized up front and trimmed to the records written
+class TrainingShard
+{
+public:
+    static const int headerSize = 256; // fixed, so the final shape can be written in place
+
+    int fd;
+    char *data;
+    size_t capacity;
+    size_t count;
+
+    TrainingShard() : fd(-1), data(NULL), capacity(0), count(0) {}
+
+    ~TrainingShard()
+    {
+        close();
+    }
+
+    bool open(const char *filename, size_t records)
+    {
+        capacity = records;
+        count = 0;
+        fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 or ftruncate(fd, getFileSize(capacity)) != 0)
+        {
+            return 0;
+        }
+        void *mapping = mmap(NULL, getFileSize(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return 0;
+        }
+        data = (char *)mapping;
+        writeHeader();
+        return 1;
+    }
+
+    static size_t getFileSize(size_t records)
+    {
+        return headerSize + records * sizeof(Transition);
+    }
+
+    void writeHeader()
+    {
+        std::string header = "{'descr': [('rows', '<u2', (" + std::to_string(Grid::rows) + ",)), ('piece', 'u1'), ('next', 'u1'), "
+                             "('action', 'u1'), ('done', 'u1'), ('reward', '<i4')], 'fortran_order': False, 'shape': (" +
+                             std::to_string(count) + ",), }";
+        header.resize(headerSize - 10 - 1, ' ');
+        header += '\n';
+
+        memcpy(data, "\x93NUMPY\x01\x00", 8);
+        data[8] = (headerSize - 10) & 0xFF;
+        data[9] = (headerSize - 10) >> 8;
+        memcpy(data + 10, header.data(), header.size());
+    }
+
+    // Slot for the next record, NULL once the shard is full
+    Transition *add()
+    {
+        if (count == capacity)
+        {
+            return NULL;
+        }
+        return (Transition *)(data + headerSize) + count++;
+    }
+
+    void close()
+    {
+        if (data)
+        {
+            writeHeader();
+            munmap(data, getFileSize(capacity));
+            data = NULL;
+            if (ftruncate(fd, getFileSize(count)) != 0)
+            {
+                std::cerr << "Cannot trim a training shard\n";
+            }
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// Many headless games stepped in lockstep, one placement per game per step
+class TrainingEnv
+{
+public:
+    static const int actionCount = 4 * Grid::cols;
+
+    enum PolicyId
+    {
+        Greedy,
+        Uniform
+    };
+
+    // Row masks, leftmost cell and width of every shape in every orientation, for evaluating placements
+    struct Shape
+    {
+        unsigned masks[4];
+        int bottoms[4]; // lowest box row filled in each box column, -1 when empty
+        int minX;
+        int width;
+    };
+
+    std::vector<Engine *> engines;
+    Shape shapes[8][4];
+    Random random; // for the uniform policy
+
+    TrainingEnv(int count, unsigned seed, const Rules &rules) : random(seed ^ 0x2545F491)
+    {
+        for (int shapeId = 1; shapeId <= 7; shapeId++)
+        {
+            Tetromino piece = Generator::getTetromino(shapeId, 0);
+            for (int orientation = 0; orientation < 4; orientation++)
+            {
+                piece.place(Block(0, 0), orientation);
+                Shape &shape = shapes[shapeId][orientation];
+                piece.getRowMasks(shape.masks);
+                int maxX = 0;
+                shape.minX = 4;
+                for (int c = 0; c < 4; c++)
+                {
+                    shape.bottoms[c] = -1;
+                }
+                for (int i = 0; i < 4; i++)
+                {
+                    Block cell = piece.blocksCurrent[i];
+                    shape.minX = std::min(shape.minX, cell.x);
+                    maxX = std::max(maxX, cell.x);
+                    shape.bottoms[cell.x] = std::max(shape.bottoms[cell.x], cell.y);
+                }
+                shape.width = maxX - shape.minX + 1;
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            Engine *engine = new Engine(seed + i);
+            engine->rules = rules;
+            engine->rules.mode = Rules::Marathon; // episodes end by block out only, as the wide engine's do
+            engine->state.highscoreFilename = NULL;
+            engine->events.unsubscribe(&engine->specialEffects); // no flying blocks without a screen
+            engine->logic.handleInput(InputEvent(InputEvent::HardDrop, 0)); // leave the title screen
+            engine->events.dispatch();
+            engines.push_back(engine);
+        }
+    }
+
+    ~TrainingEnv()
+    {
+        for (size_t i = 0; i < engines.size(); i++)
+        {
+            delete engines[i];
+        }
+    }
+
+    void observe(int env, Transition &transition)
+    {
+        Engine *engine = engines[env];
+        for (int y = 0; y < Grid::rows; y++)
+        {
+            transition.rows[y] = (engine->grid.getRowMask(y) >> Grid::wallBits) & ((1u << Grid::cols) - 1);
+        }
+        transition.piece = engine->tetromino.shapeId;
+        transition.next = PieceQueue::getShapeId(engine->queue.peek(0));
+    }
+
+    // Turns, shifts and hard drops through Logic, so kicks, locking and scoring follow the game's rules
+    void step(const unsigned char *actions, Transition *transitions)
+    {
+        for (size_t env = 0; env < engines.size(); env++)
+        {
+            Engine *engine = engines[env];
+            Logic &logic = engine->logic;
+            int orientation = actions[env] / Grid::cols;
+            int column = actions[env] % Grid::cols;
+            int score = engine->state.currentScore;
+
+            if (orientation == 3)
+            {
+                logic.handleInput(InputEvent(InputEvent::RotateCounterClockwise, 0));
+            }
+            for (int turn = 0; turn < orientation and orientation < 3; turn++)
+            {
+                logic.handleInput(InputEvent(InputEvent::Rotate, 0));
+            }
+
+            int dx = column - getMinX(engine->tetromino);
+            while (dx != 0 and logic.tryMoveX(dx > 0 ? 1 : -1))
+            {
+                dx += dx > 0 ? -1 : 1;
+            }
+
+            // The placement actually made: a blocked turn or shift leaves the piece short of the request
+            transitions[env].action = engine->tetromino.orientation * Grid::cols + getMinX(engine->tetromino);
+            logic.handleInput(InputEvent(InputEvent::HardDrop, 0));
+
+            transitions[env].reward = engine->state.currentScore - score;
+            transitions[env].done = engine->state.currentState == GameState::GameOver;
+            if (transitions[env].done)
+            {
+                logic.handleInput(InputEvent(InputEvent::HardDrop, 0)); // start the next game
+            }
+            engine->events.dispatch();
+        }
+    }
+
+    static int getMinX(Tetromino &tetromino)
+    {
+        int minX = Grid::cols;
+        for (int i = 0; i < 4; i++)
+        {
+            minX = std::min(minX, tetromino.blocksCurrent[i].x);
+        }
+        return minX;
+    }
+
+    void chooseActions(int policy, unsigned char *actions)
+    {
+        for (size_t env = 0; env < engines.size(); env++)
+        {
+            actions[env] = policy == Uniform ? chooseUniform(engines[env]) : chooseGreedy(engines[env]);
+        }
+    }
+
+    unsigned char chooseUniform(Engine *engine)
+    {
+        int shapeId = engine->tetromino.shapeId;
+        int orientation = random.next(4);
+        return orientation * Grid::cols + random.next(Grid::cols - shapes[shapeId][orientation].width + 1);
+    }
+
+    // Straight drops from the spawn rows scored on lines, height, holes and bumpiness
+    unsigned char chooseGreedy(Engine *engine)
+    {
+        int shapeId = engine->tetromino.shapeId;
+        int spawnY = engine->tetromino.getBox().y;
+        int best = 0, bestScore = INT_MIN;
+
+        // Dropping from above, a piece stops on the topmost filled cell of each column it covers
+        int board[Grid::bufferRows + Grid::rows];
+        int tops[Grid::cols];
+        for (int c = 0; c < Grid::cols; c++)
+        {
+            tops[c] = Grid::rows;
+        }
+        for (int r = Grid::bufferRows + Grid::rows - 1; r >= 0; r--)
+        {
+            board[r] = (engine->grid.getRowMask(r - Grid::bufferRows) >> Grid::wallBits) & ((1 << Grid::cols) - 1);
+            for (int row = board[r]; row; row &= row - 1)
+            {
+                tops[__builtin_ctz(row)] = r - Grid::bufferRows;
+            }
+        }
+        int surface = *std::min_element(tops, tops + Grid::cols);
+
+        for (int orientation = 0; orientation < 4; orientation++)
+        {
+            Shape &shape = shapes[shapeId][orientation];
+            for (int column = 0; column + shape.width <= Grid::cols; column++)
+            {
+                int x = column - shape.minX;
+                if (engine->grid.collides(shape.masks, x, spawnY))
+                {
+                    continue;
+                }
+                int y = Grid::rows;
+                for (int c = 0; c < 4; c++)
+                {
+                    if (shape.bottoms[c] >= 0)
+                    {
+                        y = std::min(y, tops[x + c] - shape.bottoms[c] - 1);
+                    }
+                }
+
+                int score = evaluate(board, std::max(std::min(surface, y) + Grid::bufferRows, 0), shape, x, y);
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    best = orientation * Grid::cols + column;
+                }
+            }
+        }
+        return best;
+    }
+
+    // board holds hidden and visible rows top to bottom, column x in bit x, all empty above row start;
+    // works on whole rows at a time
+    static int evaluate(const int *board, int start, const Shape &shape, int x, int y)
+    {
+        const int full = (1 << Grid::cols) - 1;
+        int rows[Grid::bufferRows + Grid::rows];
+        int count = 0, lines = 0;
+        for (int r = start; r < Grid::bufferRows + Grid::rows; r++)
+        {
+            int row = board[r];
+            int pieceRow = r - Grid::bufferRows - y;
+            if (pieceRow >= 0 and pieceRow < 4)
+            {
+                row |= (shape.masks[pieceRow] << (x + Grid::wallBits)) >> Grid::wallBits;
+            }
+            if (row == full)
+            {
+                lines++;
+            }
+            else
+            {
+                rows[count++] = row;
+            }
+        }
+
+        // Top down: a column's height comes from its first filled cell, every empty cell below one is a hole
+        int heights[Grid::cols] = {0};
+        int holes = 0, covered = 0;
+        for (int r = 0; r < count; r++)
+        {
+            for (int top = rows[r] & ~covered; top; top &= top - 1)
+            {
+                heights[__builtin_ctz(top)] = count - r;
+            }
+            covered |= rows[r];
+            holes += __builtin_popcount(covered & ~rows[r]);
+        }
+
+        int height = 0, bumpiness = 0;
+        for (int c = 0; c < Grid::cols; c++)
+        {
+            height += heights[c];
+            bumpiness += c > 0 ? abs(heights[c] - heights[c - 1]) : 0;
+        }
+        return 76 * lines - 51 * height - 36 * holes - 18 * bumpiness;
+    }
+};
+
+// Fills one shard per thread with transitions from its own batch of games
+class TrainingExport
+{
+public:
+    static bool run(const char *directory, size_t transitions, int envs, int threads, int policy, unsigned seed, const Rules &rules)
+    {
+        threads = std::max(threads, 1);
+        envs = std::max(envs, threads);
+        size_t perThread = (transitions + threads - 1) / threads;
+        std::vector<TrainingShard *> shards;
+        for (int t = 0; t < threads; t++)
+        {
+            char filename[64];
+            snprintf(filename, sizeof(filename), "/shard-%03d.npy", t);
+            shards.push_back(new TrainingShard());
+            if (!shards[t]->open((std::string(directory) + filename).c_str(), std::min(perThread, transitions - std::min(transitions, t * perThread))))
+            {
+                std::cerr << "Cannot write " << directory << filename << "\n";
+                for (int i = 0; i <= t; i++)
+                {
+                    delete shards[i];
+                }
+                return 0;
+            }
+        }
+
+        sf::Clock clock;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++)
+        {
+            int count = envs / threads + (t < envs % threads);
+            workers.push_back(std::thread(fill, shards[t], count, policy, seed + t * envs, &rules));
+        }
+        for (int t = 0; t < threads; t++)
+        {
+            workers[t].join();
+        }
+        double seconds = clock.getElapsedTime().asSeconds();
+
+        size_t written = 0;
+        for (int t = 0; t < threads; t++)
+        {
+            written += shards[t]->count;
+            delete shards[t];
+        }
+        std::cout << written << " transitions in " << seconds << " s, " << (seconds > 0 ? written / seconds : 0) << " per second\n";
+        return 1;
+    }
+
+    static void fill(TrainingShard *shard, int envs, int policy, unsigned seed, const Rules *rules)
+    {
+        TrainingEnv env(envs, seed, *rules);
+        std::vector<unsigned char> actions(envs);
+        std::vector<Transition> batch(envs);
+
+        while (shard->count < shard->capacity)
+        {
+            for (int i = 0; i < envs; i++)
+            {
+                env.observe(i, batch[i]);
+            }
+            env.chooseActions(policy, actions.data());
+            env.step(actions.data(), batch.data());
+            for (int i = 0; i < envs; i++)
+            {
+                Transition *record = shard->add();
+                if (!record)
+                {
+                    break;
+                }
+                *record = batch[i];
+            }
+        }
+    }
+};
+
+// One board row of every WideEngine game: GCC lowers it to a single AVX2 register with -mavx2, to SSE2 pairs otherwise
+typedef unsigned short WideRow __attribute__((vector_size(32)));
+
+// Without -mavx2, the WideEngine loops also get an AVX2 copy that the loader picks on CPUs that have it
+#if defined(__x86_64__) and !defined(__AVX2__)
+#define WIDE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define WIDE_KERNEL
+#endif
+
+// Sixteen independent games placed in lockstep, with row r of every board sharing one vector, so
+// collision, drop and line clear run for all games at once. Placements follow the same rules as
+// TrainingEnv::step on a scalar Engine, and WideCheck compares the two bit for bit
+class WideEngine
+{
+public:
+    static const int lanes = sizeof(WideRow) / sizeof(unsigned short);
+
+    // Instructions the rows run as on this CPU
+    static const char *getPath()
+    {
+#if defined(__AVX2__)
+        return "AVX2";
+#elif defined(__x86_64__)
+        return __builtin_cpu_supports("avx2") ? "AVX2 at run time" : "SSE2 pairs";
+#elif defined(__SSE2__)
+        return "SSE2 pairs";
+#else
+        return "scalar halves";
+#endif
+    }
+    static const int skyRows = 4;                         // open rows above the buffer, reachable only by kicks
+    static const int top = skyRows + Grid::bufferRows;    // vector row of visible row 0
+    static const int height = top + Grid::rows;           // vector row of the floor
+    static const unsigned short walls = 0xFFFF & ~(((1 << Grid::cols) - 1) << 1); // column x in bit x + 1
+
+    struct Shape
+    {
+        unsigned masks[4]; // box rows, box column c in bit c
+        int boxSize;
+        int minX;
+        int minY, maxY;
+    };
+
+    // Per-game bookkeeping that stays scalar: the queue, the falling piece and the score
+    struct Lane
+    {
+        Random random;
+        PieceQueue queue;
+        int shapeId, orientation, boxX, boxY;
+        int score, level, lines, combo;
+
+        Lane() : queue(&random) {}
+    };
+
+    WideRow board[height + 1];
+    WideRow piece[height + 1];
+    WideRow candidate[height + 1];
+    Shape shapes[8][4];
+    Lane lane[lanes];
+    Rules rules;
+
+    WideEngine(unsigned seed, const Rules &gameRules) : rules(gameRules)
+    {
+        for (int shapeId = 1; shapeId <= 7; shapeId++)
+        {
+            Tetromino tetromino = Generator::getTetromino(shapeId, 0);
+            for (int orientation = 0; orientation < 4; orientation++)
+            {
+                Shape &shape = shapes[shapeId][orientation];
+                tetromino.place(Block(0, 0), orientation);
+                tetromino.getRowMasks(shape.masks);
+                shape.boxSize = tetromino.boxSize;
+                shape.minX = shape.minY = 4;
+                shape.maxY = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    shape.minX = std::min(shape.minX, tetromino.blocksCurrent[i].x);
+                    shape.minY = std::min(shape.minY, tetromino.blocksCurrent[i].y);
+                    shape.maxY = std::max(shape.maxY, tetromino.blocksCurrent[i].y);
+                }
+            }
+        }
+
+        for (int r = 0; r <= height; r++)
+        {
+            for (int l = 0; l < lanes; l++)
+            {
+                board[r][l] = r < height ? walls : 0xFFFF;
+            }
+        }
+
+        // Same draws as a fresh Engine leaving the title screen: one fill in the constructor, one at game start
+        for (int l = 0; l < lanes; l++)
+        {
+            lane[l].random.setSeed(seed + l);
+            lane[l].queue.reset();
+            restart(l);
+        }
+    }
+
+    // All ones in the lanes whose bit is set
+    static void getLaneMask(unsigned bits, WideRow &mask)
+    {
+        for (int l = 0; l < lanes; l++)
+        {
+            mask[l] = bits >> l & 1 ? 0xFFFF : 0;
+        }
+    }
+
+    void restart(int l)
+    {
+        Lane &game = lane[l];
+        for (int r = 0; r < height; r++)
+        {
+            board[r][l] = walls;
+        }
+        game.score = 0;
+        game.level = 1;
+        game.lines = 0;
+        game.combo = -1;
+        game.queue.reset();
+        spawn(l);
+    }
+
+    // Same column choice as GameState::spawnTetromino, from this lane's rows; false on block out
+    bool spawn(int l)
+    {
+        Lane &game = lane[l];
+        game.shapeId = PieceQueue::getShapeId(game.queue.pop());
+        game.orientation = 0;
+        game.boxY = -2;
+
+        const Shape &shape = shapes[game.shapeId][0];
+        unsigned blocked = 0;
+        for (int r = 0; r < 4; r++)
+        {
+            for (unsigned cells = shape.masks[r]; cells; cells &= cells - 1)
+            {
+                blocked |= board[top + game.boxY + r][l] >> __builtin_ctz(cells);
+            }
+        }
+        unsigned fits = ~blocked >> 1 & ((1 << Grid::cols) - 1);
+        game.boxX = Rules::chooseSpawnColumn(fits, shape.boxSize, rules.spawnPolicy, game.random);
+        if (game.boxX < 0)
+        {
+            game.boxX = (Grid::cols - shape.boxSize) / 2;
+            return 0;
+        }
+        return 1;
+    }
+
+    // Writes one lane's piece into rows; false when a cell would leave the board sideways
+    bool drawPiece(WideRow *rows, int l, int shapeId, int orientation, int boxX, int boxY)
+    {
+        const Shape &shape = shapes[shapeId][orientation];
+        for (int r = 0; r < 4; r++)
+        {
+            if (!shape.masks[r])
+            {
+                continue;
+            }
+            int shift = boxX + 1;
+            unsigned bits = shift < 0 ? shape.masks[r] >> -shift : shape.masks[r] << shift;
+            int row = boxY + top + r;
+            if ((shift < 0 and (shape.masks[r] & ((1u << -shift) - 1))) or (bits & ~0xFFFFu) or row < 0 or row > height)
+            {
+                return 0;
+            }
+            rows[row][l] |= bits;
+        }
+        return 1;
+    }
+
+    void clearRows(WideRow *rows)
+    {
+        memset(rows, 0, sizeof(WideRow) * (height + 1));
+    }
+
+    // Lanes whose rows overlap the stack, a wall or the floor, one bit per lane
+    WIDE_KERNEL unsigned collide(const WideRow *rows)
+    {
+        WideRow hit = rows[0] & board[0];
+        for (int r = 1; r <= height; r++)
+        {
+            hit |= rows[r] & board[r];
+        }
+        unsigned lanesHit = 0;
+        for (int l = 0; l < lanes; l++)
+        {
+            lanesHit |= (hit[l] != 0) << l;
+        }
+        return lanesHit;
+    }
+
+    // Both rotation presses of TrainingEnv::step: all lanes try kick k together, lanes that fit drop out
+    WIDE_KERNEL void rotate(const unsigned char *actions)
+    {
+        for (int press = 0; press < 2; press++)
+        {
+            unsigned pending = 0;
+            for (int l = 0; l < lanes; l++)
+            {
+                int orientation = actions[l] / Grid::cols;
+                pending |= (press == 0 ? orientation != 0 : orientation == 2) << l;
+            }
+
+            for (int k = 0; k < 5 and pending; k++)
+            {
+                unsigned outside = 0;
+                clearRows(candidate);
+                for (int l = 0; l < lanes; l++)
+                {
+                    if (pending >> l & 1)
+                    {
+                        Lane &game = lane[l];
+                        int direction = actions[l] / Grid::cols == 3 ? -1 : 1;
+                        const int *kick = Logic::getKicks(game.shapeId, game.orientation, direction)[k];
+                        if (!drawPiece(candidate, l, game.shapeId, (game.orientation + direction) & 3, game.boxX + kick[0], game.boxY - kick[1]))
+                        {
+                            outside |= 1u << l;
+                        }
+                    }
+                }
+
+                unsigned fits = pending & ~(collide(candidate) | outside);
+                for (int l = 0; l < lanes; l++)
+                {
+                    if (fits >> l & 1)
+                    {
+                        Lane &game = lane[l];
+                        int direction = actions[l] / Grid::cols == 3 ? -1 : 1;
+                        const int *kick = Logic::getKicks(game.shapeId, game.orientation, direction)[k];
+                        game.orientation = (game.orientation + direction) & 3;
+                        game.boxX += kick[0];
+                        game.boxY -= kick[1];
+                    }
+                }
+                pending &= ~fits;
+            }
+        }
+    }
+
+    // One column per round for every lane still short of its target, stopping lanes that hit something
+    WIDE_KERNEL void shift(const unsigned char *actions)
+    {
+        int dx[lanes];
+        unsigned moving = 0;
+        clearRows(piece);
+        for (int l = 0; l < lanes; l++)
+        {
+            Lane &game = lane[l];
+            drawPiece(piece, l, game.shapeId, game.orientation, game.boxX, game.boxY);
+            dx[l] = actions[l] % Grid::cols - (game.boxX + shapes[game.shapeId][game.orientation].minX);
+            moving |= (dx[l] != 0) << l;
+        }
+
+        while (moving)
+        {
+            unsigned right = 0;
+            for (int l = 0; l < lanes; l++)
+            {
+                right |= (dx[l] > 0) << l;
+            }
+            WideRow rightMask, leftMask, accept;
+            getLaneMask(moving & right, rightMask);
+            getLaneMask(moving & ~right, leftMask);
+            for (int r = 0; r <= height; r++)
+            {
+                candidate[r] = ((piece[r] << 1) & rightMask) | ((piece[r] >> 1) & leftMask);
+            }
+
+            unsigned moved = moving & ~collide(candidate);
+            getLaneMask(moved, accept);
+            for (int r = 0; r <= height; r++)
+            {
+                piece[r] = (candidate[r] & accept) | (piece[r] & ~accept);
+            }
+
+            for (int l = 0; l < lanes; l++)
+            {
+                if (moved >> l & 1)
+                {
+                    int step = dx[l] > 0 ? 1 : -1;
+                    lane[l].boxX += step;
+                    dx[l] -= step;
+                }
+            }
+            moving = moved;
+            for (int l = 0; l < lanes; l++)
+            {
+                moving &= ~((dx[l] == 0) << l);
+            }
+        }
+    }
+
+    // Moves every piece down a row per round until each one lands; returns the rows fallen per lane
+    WIDE_KERNEL void drop(int *distance)
+    {
+        unsigned falling = (1u << lanes) - 1;
+        for (int l = 0; l < lanes; l++)
+        {
+            distance[l] = 0;
+        }
+
+        while (falling)
+        {
+            candidate[0] = WideRow();
+            for (int r = 1; r <= height; r++)
+            {
+                candidate[r] = piece[r - 1];
+            }
+
+            falling &= ~collide(candidate);
+            WideRow accept;
+            getLaneMask(falling, accept);
+            for (int r = 0; r <= height; r++)
+            {
+                piece[r] = (candidate[r] & accept) | (piece[r] & ~accept);
+            }
+            for (int l = 0; l < lanes; l++)
+            {
+                distance[l] += falling >> l & 1;
+                lane[l].boxY += falling >> l & 1;
+            }
+        }
+    }
+
+    // Full rows in the buffer and the visible board are removed in every lane at once: a lane whose
+    // row r is full takes every row above it down by one, then row r is checked again
+    WIDE_KERNEL void clearLines(int *cleared)
+    {
+        for (int l = 0; l < lanes; l++)
+        {
+            cleared[l] = 0;
+        }
+
+        WideRow empty = WideRow() + walls;
+        for (int r = height - 1; r >= skyRows;)
+        {
+            WideRow full = board[r] == (unsigned short)0xFFFF;
+            unsigned fullLanes = 0;
+            for (int l = 0; l < lanes; l++)
+            {
+                fullLanes |= (full[l] != 0) << l;
+                cleared[l] += full[l] != 0;
+            }
+            if (!fullLanes)
+            {
+                r--;
+                continue;
+            }
+
+            WideRow mask = (WideRow)full;
+            for (int above = r; above > skyRows; above--)
+            {
+                board[above] = (board[above - 1] & mask) | (board[above] & ~mask);
+            }
+            board[skyRows] = (empty & mask) | (board[skyRows] & ~mask);
+        }
+    }
+
+    // Same outcome as TrainingEnv::step for the same actions: rewards are score gains, dones mark ended games
+    WIDE_KERNEL void step(const unsigned char *actions, int *rewards, unsigned char *dones)
+    {
+        int distance[lanes];
+        int cleared[lanes];
+
+        rotate(actions);
+        shift(actions);
+        drop(distance);
+
+        for (int r = 0; r <= height; r++)
+        {
+            board[r] |= piece[r];
+        }
+        clearLines(cleared);
+
+        for (int l = 0; l < lanes; l++)
+        {
+            Lane &game = lane[l];
+            const Shape &shape = shapes[game.shapeId][game.orientation];
+            int before = game.score;
+            game.score += distance[l] * rules.hardDropPoints;
+            dones[l] = 0;
+
+            // Lock out ends the game before anything is scored or spawned
+            if (game.boxY + shape.minY < -Grid::bufferRows or game.boxY + shape.maxY < 0)
+            {
+                dones[l] = 1;
+                rewards[l] = game.score - before;
+                continue;
+            }
+
+            if (cleared[l] == 0)
+            {
+                game.combo = -1;
+            }
+            else
+            {
+                game.combo++;
+                game.score += rules.getLineClearPoints(cleared[l], game.level) + rules.getComboPoints(game.combo, game.level);
+                game.lines += cleared[l];
+                while (rules.isLevelReached(game.lines, game.level))
+                {
+                    game.level++;
+                }
+            }
+            rewards[l] = game.score - before;
+            dones[l] = !spawn(l); // block out
+        }
+
+        for (int l = 0; l < lanes; l++)
+        {
+            if (dones[l])
+            {
+                restart(l);
+            }
+        }
+    }
+
+    unsigned short getRow(int l, int y)
+    {
+        return board[y + top][l] >> 1 & ((1 << Grid::cols) - 1);
+    }
+};
+
+// Steps a WideEngine and a scalar TrainingEnv side by side on the same seeds and random actions
+class WideCheck
+{
+public:
+    static int run(int steps, unsigned seed, const Rules &rules)
+    {
+        TrainingEnv scalar(WideEngine::lanes, seed, rules);
+        WideEngine wide(seed, rules); // on the stack, where the compiler keeps the vectors aligned
+        Random random(seed ^ 0x68E31DA4);
+
+        unsigned char actions[WideEngine::lanes];
+        Transition transitions[WideEngine::lanes];
+        int rewards[WideEngine::lanes];
+        unsigned char dones[WideEngine::lanes];
+        double scalarSeconds = 0, wideSeconds = 0;
+        int mismatches = 0;
+
+        for (int step = 0; step < steps; step++)
+        {
+            for (int l = 0; l < WideEngine::lanes; l++)
+            {
+                actions[l] = scalar.chooseUniform(scalar.engines[l]);
+            }
+
+            sf::Clock clock;
+            scalar.step(actions, transitions);
+            scalarSeconds += clock.restart().asSeconds();
+            wide.step(actions, rewards, dones);
+            wideSeconds += clock.restart().asSeconds();
+
+            for (int l = 0; l < WideEngine::lanes; l++)
+            {
+                if (!isSame(scalar, wide, l, transitions[l], rewards[l], dones[l]) and mismatches++ < 10)
+                {
+                    std::cerr << "Step " << step << " game " << l << " differs\n";
+                }
+            }
+        }
+
+        double placements = (double)steps * WideEngine::lanes;
+        std::cout << steps << " steps of " << WideEngine::lanes << " games: scalar " << placements / scalarSeconds << " placements/s, wide ("
+                  << WideEngine::getPath() << ") " << placements / wideSeconds << " placements/s, " << mismatches << " mismatches\n";
+        return mismatches;
+    }
+
+    // Whether game l ended the step identically in both engines: reward, game over, next piece and every row
+    static bool isSame(TrainingEnv &scalar, WideEngine &wide, int l, const Transition &transition, int reward, unsigned char done)
+    {
+        Engine *engine = scalar.engines[l];
+        Block box = engine->tetromino.getBox();
+        bool same = transition.reward == reward and transition.done == done and engine->tetromino.shapeId == wide.lane[l].shapeId and
+                    box.x == wide.lane[l].boxX and box.y == wide.lane[l].boxY;
+        for (int y = -Grid::bufferRows; y < Grid::rows; y++)
+        {
+            same = same and ((engine->grid.getRowMask(y) >> Grid::wallBits) & ((1 << Grid::cols) - 1)) == wide.getRow(l, y);
+        }
+        return same;
+    }
+};
+
+// Plays input streams decoded from arbitrary bytes through a headless engine and checks it after every
+// tick: row masks against cells, the falling piece against the stack, the bit mask collision and drop
+// paths against cell-by-cell references, and snapshot round trips. The same bytes, read as placements,
+// also step the wide engine against the scalar one. Used by --fuzz and by libFuzzer (make fuzz)
+class Fuzzer
+{
+public:
+    std::string failure; // the first broken invariant of the last run, empty when all held
+    sf::Int64 ticks;     // simulated so far, over all runs
+    sf::Int64 placements;
+
+    Fuzzer() : ticks(0), placements(0) {}
+
+    // Byte 0-3 seed, byte 4 rules (lines per level, lock delay), byte 5 rows of garbage with one hole
+    // each, mostly lined up so that multi-line clears are frequent, and the spawn policy, then one byte per input: the low
+    // 4 bits pick from inputs below, the high 4 bits the ticks to wait after it
+    bool runInput(const sf::Uint8 *data, size_t size)
+    {
+        failure.clear();
+        checkPack(data, size);
+        if (size < 6 or !failure.empty())
+        {
+            return failure.empty();
+        }
+
+        unsigned seed = data[0] | data[1] << 8 | data[2] << 16 | (unsigned)data[3] << 24;
+        Engine engine(seed);
+        engine.state.highscoreFilename = NULL;
+        engine.rules.linesPerLevel = 1 + (data[4] & 15);
+        engine.rules.lockDelayMicroseconds = (data[4] >> 4) * 50000;
+        engine.rules.spawnPolicy = data[5] / 64 % 3;
+        engine.rules.prepare();
+
+        Random holes(seed);
+        int hole = holes.next(Grid::cols);
+        for (int y = Grid::rows - 1; y >= Grid::rows - (data[5] % Grid::rows); y--)
+        {
+            hole = holes.next(4) ? hole : holes.next(Grid::cols);
+            for (int x = 0; x < Grid::cols; x++)
+            {
+                engine.grid.getRow(y)[x] = x == hole ? 0 : Colors::TRed + (x + y) % 7;
+            }
+            engine.grid.updateRowMask(y);
+        }
+        engine.logic.handleInput(InputEvent(InputEvent::HardDrop, 0)); // leave the title screen
+        if (data[5] % Grid::rows and engine.grid.getRowMask(Grid::rows - 1) == Grid::wallMask)
+        {
+            fail("garbage rows lost when the game started");
+            return 0;
+        }
+
+        // Hard drops twice as likely, a pause always resumed after the wait, and three waits long
+        // enough for gravity to lock pieces
+        static const int inputs[16] = {InputEvent::MoveLeft, InputEvent::MoveLeftReleased, InputEvent::MoveRight, InputEvent::MoveRightReleased,
+                                       InputEvent::Rotate, InputEvent::RotateCounterClockwise, InputEvent::Hold, InputEvent::HardDrop, InputEvent::HardDrop,
+                                       InputEvent::SoftDropPressed, InputEvent::SoftDropReleased, InputEvent::ShadowSwitch, InputEvent::Pause, -1, -1, -1};
+
+        sf::Int64 tick = 0;
+        for (size_t i = 6; i < size and failure.empty(); i++)
+        {
+            int type = inputs[data[i] & 15];
+            int wait = data[i] >> 4;
+            if (type >= 0)
+            {
+                engine.input.push(type, tick * Logic::tickMicroseconds);
+            }
+            else
+            {
+                wait = wait * 64 + (data[i] & 15);
+            }
+            if (type == InputEvent::Pause)
+            {
+                engine.input.push(type, (tick + wait) * Logic::tickMicroseconds);
+            }
+
+            for (int t = 0; t <= wait and failure.empty(); t++)
+            {
+                tick++;
+                engine.logic.update(tick * Logic::tickMicroseconds);
+                check(engine);
+            }
+            checkSnapshot(engine);
+        }
+        ticks += tick;
+
+        if (failure.empty())
+        {
+            runWide(data, size);
+        }
+        return failure.empty();
+    }
+
+    void fail(const std::string &message)
+    {
+        if (failure.empty())
+        {
+            failure = message;
+        }
+    }
+
+    void check(Engine &engine)
+    {
+        Grid &grid = engine.grid;
+        for (int y = -Grid::bufferRows; y < Grid::rows; y++)
+        {
+            unsigned mask = Grid::wallMask;
+            for (int x = 0; x < Grid::cols; x++)
+            {
+                int value = grid.getRow(y)[x];
+                if (value != 0 and value != Colors::Grey and (value < Colors::TRed or value > Colors::TBlueDark))
+                {
+                    fail("cell holds color " + std::to_string(value));
+                }
+                mask |= value ? 1u << (x + Grid::wallBits) : 0;
+            }
+            if (grid.getRowMask(y) != mask)
+            {
+                fail("row mask " + std::to_string(y) + " out of sync with its cells");
+            }
+        }
+
+        PieceQueue &queue = engine.queue;
+        if (queue.tail - queue.head <= (unsigned)PieceQueue::maxPreview or queue.tail - queue.head > (unsigned)PieceQueue::capacity)
+        {
+            fail("queue holds " + std::to_string(queue.tail - queue.head) + " pieces");
+        }
+        for (int i = 0; i <= PieceQueue::maxPreview; i++)
+        {
+            int shapeId = PieceQueue::getShapeId(queue.peek(i));
+            if (shapeId < Tetromino::Shape_O or shapeId > Tetromino::Shape_T)
+            {
+                fail("queued shape " + std::to_string(shapeId));
+            }
+        }
+
+        GameState &state = engine.state;
+        if (state.currentScore < 0 or state.linesCleared < 0 or state.difficultyLevel < 1)
+        {
+            fail("negative score or lines, or level below 1");
+        }
+        if (state.currentState == GameState::Playing or state.currentState == GameState::Pause)
+        {
+            checkPiece(engine);
+        }
+    }
+
+    // The falling piece keeps its shape, fits where it is, and both collision paths and both drop
+    // paths agree around it, including against walls, the floor and the sky above the hidden rows
+    void checkPiece(Engine &engine)
+    {
+        Tetromino &piece = engine.tetromino;
+        if (piece.shapeId < Tetromino::Shape_O or piece.shapeId > Tetromino::Shape_T)
+        {
+            fail("falling shape " + std::to_string(piece.shapeId));
+            return;
+        }
+
+        Block box = piece.getBox();
+        for (int i = 0; i < 4; i++)
+        {
+            Block cell = piece.getCell(i, piece.orientation);
+            if (piece.blocksCurrent[i].x != box.x + cell.x or piece.blocksCurrent[i].y != box.y + cell.y)
+            {
+                fail("falling piece lost its shape");
+                return;
+            }
+        }
+
+        if (!engine.logic.isCurrentPositionValid())
+        {
+            fail("falling piece overlaps the stack or leaves the board");
+        }
+
+        unsigned masks[4];
+        piece.getRowMasks(masks);
+        for (int dy = -6; dy <= 2; dy++)
+        {
+            for (int dx = -3; dx <= 3; dx++)
+            {
+                if (engine.grid.collides(masks, box.x + dx, box.y + dy) != collides(engine.grid, piece, dx, dy))
+                {
+                    fail("mask collision disagrees with cells at offset " + std::to_string(dx) + "," + std::to_string(dy));
+                }
+            }
+        }
+
+        int distance = 0;
+        while (!collides(engine.grid, piece, 0, distance + 1))
+        {
+            distance++;
+        }
+        if (engine.logic.getDropDistance() != distance)
+        {
+            fail("drop distance " + std::to_string(engine.logic.getDropDistance()) + ", cells say " + std::to_string(distance));
+        }
+        if (piece.currentHardDropMaxDistance != distance)
+        {
+            fail("ghost drawn " + std::to_string(piece.currentHardDropMaxDistance) + " rows down, cells say " + std::to_string(distance));
+        }
+    }
+
+    // Cell by cell: walls and the floor block, the sky above the hidden rows is open
+    static bool collides(Grid &grid, Tetromino &piece, int dx, int dy)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            int x = piece.blocksCurrent[i].x + dx;
+            int y = piece.blocksCurrent[i].y + dy;
+            if (x < 0 or x >= Grid::cols or y >= Grid::rows or (y >= -Grid::bufferRows and grid.getRow(y)[x]))
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // The bytes as puzzle pack text, copied to a buffer of exactly their size so that a sanitizer catches
+    // any read past it: every puzzle's lines lie inside the text
+    void checkPack(const sf::Uint8 *data, size_t size)
+    {
+        std::vector<char> text(data, data + size);
+        const char *begin = text.empty() ? NULL : &text[0];
+        PuzzlePack pack;
+        pack.index(StringView(begin, size));
+        for (int i = 0; i < pack.getCount(); i++)
+        {
+            PuzzlePack::Puzzle puzzle;
+            pack.get(i, puzzle);
+            bool inside = isInside(puzzle.queue, begin, size) and puzzle.rowCount <= Grid::rows;
+            for (int r = 0; r < puzzle.rowCount; r++)
+            {
+                inside = inside and isInside(puzzle.rows[r], begin, size) and !puzzle.rows[r].empty();
+            }
+            if (!inside)
+            {
+                fail("puzzle " + std::to_string(i) + " of a pack reaches outside its text");
+                return;
+            }
+        }
+    }
+
+    static bool isInside(StringView view, const char *begin, size_t size)
+    {
+        return view.empty() or (view.data >= begin and view.data + view.size <= begin + size);
+    }
+
+    // A snapshot restored into a fresh engine captures back to the same bytes
+    void checkSnapshot(Engine &engine)
+    {
+        Snapshot snapshot, copy;
+        engine.capture(snapshot);
+        Engine restored(0);
+        restored.restore(snapshot);
+        restored.capture(copy);
+        if (memcmp(&snapshot, &copy, sizeof(snapshot)) != 0)
+        {
+            fail("snapshot does not survive a restore");
+        }
+    }
+
+    // The bytes after the seed as placements, one per game per step: the greedy policy's when the top
+    // bit is set, so lines get cleared, otherwise any column and orientation, reachable or not. The
+    // scalar games are checked like the tick-driven one after every step
+    void runWide(const sf::Uint8 *data, size_t size)
+    {
+        Rules rules;
+        rules.spawnPolicy = data[5] / 64 % 3;
+        unsigned seed = data[0] | data[1] << 8 | data[2] << 16 | (unsigned)data[3] << 24;
+        TrainingEnv scalar(WideEngine::lanes, seed, rules);
+        WideEngine wide(seed, rules);
+
+        unsigned char actions[WideEngine::lanes];
+        Transition transitions[WideEngine::lanes];
+        int rewards[WideEngine::lanes];
+        unsigned char dones[WideEngine::lanes];
+        for (size_t i = 4; i + WideEngine::lanes <= size; i += WideEngine::lanes)
+        {
+            for (int l = 0; l < WideEngine::lanes; l++)
+            {
+                actions[l] = data[i + l] & 0x80 ? scalar.chooseGreedy(scalar.engines[l]) : data[i + l] % TrainingEnv::actionCount;
+            }
+            scalar.step(actions, transitions);
+            wide.step(actions, rewards, dones);
+            placements += WideEngine::lanes;
+            for (int l = 0; l < WideEngine::lanes; l++)
+            {
+                check(*scalar.engines[l]);
+                if (!failure.empty())
+                {
+                    failure += " in wide game " + std::to_string(l);
+                    return;
+                }
+                if (!WideCheck::isSame(scalar, wide, l, transitions[l], rewards[l], dones[l]))
+                {
+                    fail("wide engine differs from the scalar one in game " + std::to_string(l) + " at step " + std::to_string((i - 4) / WideEngine::lanes));
+                    return;
+                }
+            }
+        }
+    }
+
+    // Random inputs of random length; the first failing one is written to a file that the libFuzzer
+    // build takes as an argument. Returns the number of failing inputs
+    static int run(int iterations, unsigned seed)
+    {
+        Fuzzer fuzzer;
+        Random random(seed);
+        std::vector<sf::Uint8> data;
+        int failures = 0;
+        sf::Clock clock;
+
+        // Packs that once broke the parser: a last puzzle without a blank line after it
+        const char *packs[] = {"#########.\nqueue IJL\n", "#########.\nqueue IJL", "queue O\n\nhold T\nqueue S"};
+        for (int i = 0; i < 3; i++)
+        {
+            PuzzlePack pack;
+            pack.index(StringView(packs[i], strlen(packs[i])));
+            fuzzer.checkPack((const sf::Uint8 *)packs[i], strlen(packs[i]));
+            if (pack.getCount() != 1 + (i == 2) or !fuzzer.failure.empty())
+            {
+                std::cerr << "Pack " << i << ": " << pack.getCount() << " puzzles " << fuzzer.failure << "\n";
+                failures++;
+            }
+        }
+
+        for (int i = 0; i < iterations; i++)
+        {
+            data.resize(6 + random.next(2048));
+            for (size_t j = 0; j < data.size(); j++)
+            {
+                data[j] = random.next(256);
+            }
+            if (!fuzzer.runInput(&data[0], data.size()) and failures++ == 0)
+            {
+                std::string filename = "fuzz-" + std::to_string(seed) + "-" + std::to_string(i) + ".bin";
+                std::ofstream(filename.c_str(), std::ios::binary).write((const char *)&data[0], data.size());
+                std::cerr << "Input " << i << ": " << fuzzer.failure << " (saved to " << filename << ")\n";
+            }
+        }
+
+        float seconds = clock.getElapsedTime().asSeconds();
+        std::cout << iterations << " inputs: " << fuzzer.ticks / seconds << " checked ticks/s, " << fuzzer.placements / seconds << " differential placements/s, "
+                  << failures << " failures\n";
+        return failures;
+    }
+};
+
+// Searches placement sequences for a perfect clear, or for the most line-clearing T-spins, within a piece
+// budget. A piece may stop anywhere it can reach from above the stack with shifts, soft drops and SRS
+// kicks, and the hold slot swaps as in the game. The budget grows one piece or one spin at a time,
+// states that already failed are remembered by hash, and the first moves are shared out between threads
+class Solver
+{
+public:
+    enum Goal
+    {
+        PerfectClear,
+        TSpins
+    };
+
+    static const unsigned fullRow = (1u << Grid::cols) - 1;
+    static const int minY = -Grid::bufferRows - 4; // highest box row kicks can lift a piece to
+    static const int spanX = Grid::cols + 3;       // box columns -2..cols
+    static const int spanY = Grid::rows - minY;
+    static const int memoBits = 20;
+
+    struct Board
+    {
+        unsigned short rows[Grid::rows]; // top-down like Grid, column x in bit x
+        int cells;
+    };
+
+    struct Placement
+    {
+        int shapeId, orientation, x, y; // box top-left, as Tetromino::place takes it
+        bool held;                      // played through the hold slot
+        bool spin;                      // T-spin by the three corner rule
+        int lines;
+    };
+
+    struct Result
+    {
+        bool solved;
+        int tSpins;
+        std::vector<Placement> placements;
+        unsigned long long nodes;
+        double seconds;
+    };
+
+    // One thread's depth-first search, with its own table of failed states
+    struct Search
+    {
+        Solver *solver;
+        std::vector<unsigned long long> failed;
+        std::vector<std::vector<Placement> > moves; // candidates per depth, reused between nodes
+        std::vector<Placement> path;
+        std::vector<Placement> best;
+        std::atomic<int> *found; // lowest first move that succeeded, INT_MAX while none has
+        int firstMove, bestMove;
+        unsigned long long nodes;
+
+        Search(Solver *solverPtr, std::atomic<int> *foundPtr)
+            : solver(solverPtr), failed(1u << memoBits), found(foundPtr), firstMove(0), bestMove(INT_MAX), nodes(0) {}
+
+        bool run(const Board &board, int next, int hold, int depth, int need)
+        {
+            if (depth == 0 or found->load() < firstMove)
+            {
+                return 0;
+            }
+            nodes++;
+
+            if (!solver->isPromising(board, next, hold, depth, need))
+            {
+                return 0;
+            }
+            unsigned long long hash = solver->getHash(board, next, hold, depth, need);
+            unsigned long long &slot = failed[hash & ((1u << memoBits) - 1)];
+            if (slot == hash)
+            {
+                return 0;
+            }
+
+            int limitRow = solver->getLimitRow(board, depth);
+            std::vector<Placement> &candidates = moves[depth]; // deeper calls use the lower slots
+            int shapeIds[2], nexts[2], holds[2];
+            bool helds[2];
+            int options = solver->getOptions(next, hold, shapeIds, nexts, holds, helds);
+            for (int option = 0; option < options; option++)
+            {
+                solver->findPlacements(board, shapeIds[option], limitRow, candidates);
+                for (size_t i = 0; i < candidates.size(); i++)
+                {
+                    Placement placement = candidates[i];
+                    placement.held = helds[option];
+                    Board child = solver->place(board, placement);
+                    int childNeed = need - (placement.spin and placement.lines > 0);
+
+                    path.push_back(placement);
+                    if (solver->isSolved(child, childNeed) or run(child, nexts[option], holds[option], depth - 1, childNeed))
+                    {
+                        return 1;
+                    }
+                    path.pop_back();
+                }
+            }
+
+            if (found->load() >= firstMove)
+            {
+                slot = hash; // an aborted search proves nothing
+            }
+            return 0;
+        }
+    };
+
+    Board start;
+    int goal;
+    std::vector<int> queue; // shape ids, the falling piece first
+    int heldShapeId;
+    unsigned masks[8][4][4];
+    int boxSizes[8];
+    unsigned evenColumns;
+
+    // Visible rows of the grid only: puzzles never leave cells in the hidden rows
+    Solver(Grid *grid, const std::vector<int> &shapeIds, int held = 0) : goal(PerfectClear), queue(shapeIds), heldShapeId(held), evenColumns(0)
+    {
+        start.cells = 0;
+        for (int y = 0; y < Grid::rows; y++)
+        {
+            start.rows[y] = (grid->getRowMask(y) >> Grid::wallBits) & fullRow;
+            start.cells += __builtin_popcount(start.rows[y]);
+        }
+
+        for (int shapeId = 1; shapeId <= 7; shapeId++)
+        {
+            Tetromino tetromino = Generator::getTetromino(shapeId, 0);
+            boxSizes[shapeId] = tetromino.boxSize;
+            for (int orientation = 0; orientation < 4; orientation++)
+            {
+                tetromino.place(Block(0, 0), orientation);
+                tetromino.getRowMasks(masks[shapeId][orientation]);
+            }
+        }
+
+        for (int x = 0; x < Grid::cols; x += 2)
+        {
+            evenColumns |= 1u << x;
+        }
+    }
+
+    // The falling piece, the preview and the hold slot of a running game
+    static Solver fromEngine(Engine *engine, int preview)
+    {
+        std::vector<int> shapeIds(1, engine->tetromino.shapeId);
+        for (int i = 0; i < preview; i++)
+        {
+            shapeIds.push_back(PieceQueue::getShapeId(engine->queue.peek(i)));
+        }
+        return Solver(&engine->grid, shapeIds, engine->state.heldPiece ? PieceQueue::getShapeId(engine->state.heldPiece) : 0);
+    }
+
+    Result solve(int searchGoal, int maxPieces, int threads)
+    {
+        goal = searchGoal;
+        maxPieces = std::min(maxPieces, (int)queue.size() + (heldShapeId != 0));
+        threads = std::max(threads, 1);
+
+        Result result;
+        result.solved = 0;
+        result.tSpins = 0;
+        result.nodes = 0;
+        sf::Clock clock;
+
+        std::atomic<int> found(INT_MAX);
+        std::vector<Search *> searches;
+        for (int t = 0; t < threads; t++)
+        {
+            searches.push_back(new Search(this, &found));
+            searches[t]->moves.resize(maxPieces + 1);
+        }
+
+        if (goal == PerfectClear)
+        {
+            // Every piece adds four cells and every line takes ten, so only some budgets can end empty
+            for (int depth = 1; depth <= maxPieces and !result.solved; depth++)
+            {
+                if ((start.cells + 4 * depth) % Grid::cols == 0)
+                {
+                    result.solved = deepen(searches, depth, 0, result.placements);
+                }
+            }
+        }
+        else
+        {
+            std::vector<Placement> placements;
+            for (int need = 1; deepen(searches, maxPieces, need, placements); need++)
+            {
+                result.solved = 1;
+                result.tSpins = need;
+                result.placements = placements;
+            }
+        }
+
+        for (int t = 0; t < threads; t++)
+        {
+            result.nodes += searches[t]->nodes;
+            delete searches[t];
+        }
+        result.seconds = clock.getElapsedTime().asSeconds();
+        return result;
+    }
+
+    // One iteration: the root's moves are dealt round robin, and the lowest one that works wins
+    bool deepen(std::vector<Search *> &searches, int depth, int need, std::vector<Placement> &placements)
+    {
+        if (!isPromising(start, 0, heldShapeId, depth, need))
+        {
+            return 0;
+        }
+
+        std::vector<Placement> roots;
+        std::vector<int> rootOptions;
+        int shapeIds[2], nexts[2], holds[2];
+        bool helds[2];
+        int options = getOptions(0, heldShapeId, shapeIds, nexts, holds, helds);
+        for (int option = 0; option < options; option++)
+        {
+            std::vector<Placement> candidates;
+            findPlacements(start, shapeIds[option], getLimitRow(start, depth), candidates);
+            for (size_t i = 0; i < candidates.size(); i++)
+            {
+                candidates[i].held = helds[option];
+                roots.push_back(candidates[i]);
+                rootOptions.push_back(option);
+            }
+        }
+
+        std::atomic<int> &found = *searches[0]->found;
+        found = INT_MAX;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < searches.size(); t++)
+        {
+            searches[t]->bestMove = INT_MAX;
+            workers.push_back(std::thread(&Solver::searchRoots, this, searches[t], (int)t, (int)searches.size(), &roots, &rootOptions, depth, need,
+                                          nexts, holds));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+        {
+            workers[t].join();
+        }
+
+        for (size_t t = 0; t < searches.size() and found != INT_MAX; t++)
+        {
+            if (searches[t]->bestMove == found)
+            {
+                placements = searches[t]->best;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    void searchRoots(Search *search, int thread, int threads, const std::vector<Placement> *roots, const std::vector<int> *rootOptions, int depth,
+                     int need, const int *nexts, const int *holds)
+    {
+        for (int i = thread; i < (int)roots->size() and i < search->found->load(); i += threads)
+        {
+            Placement root = (*roots)[i];
+            int option = (*rootOptions)[i];
+            Board child = place(start, root);
+            int childNeed = need - (root.spin and root.lines > 0);
+
+            search->firstMove = i;
+            search->path.assign(1, root);
+            if (isSolved(child, childNeed) or search->run(child, nexts[option], holds[option], depth - 1, childNeed))
+            {
+                search->bestMove = i;
+                search->best = search->path;
+                int lowest = search->found->load();
+                while (i < lowest and !search->found->compare_exchange_weak(lowest, i))
+                {
+                }
+                return; // later roots of this thread can only lose to this one
+            }
+        }
+    }
+
+    bool isSolved(const Board &board, int need)
+    {
+        return goal == PerfectClear ? board.cells == 0 : need <= 0;
+    }
+
+    // The piece played next: the falling one, or through the hold slot the held one (or the one after
+    // it, with the hold empty). Returns how many of the two exist; swaps that change nothing are left out
+    int getOptions(int next, int hold, int *shapeIds, int *nexts, int *holds, bool *helds)
+    {
+        int options = 0;
+        int size = queue.size();
+        if (next < size)
+        {
+            shapeIds[options] = queue[next];
+            nexts[options] = next + 1;
+            holds[options] = hold;
+            helds[options++] = 0;
+        }
+        if (hold and (next >= size or hold != queue[next]))
+        {
+            shapeIds[options] = hold;
+            nexts[options] = std::min(next + 1, size);
+            holds[options] = next < size ? queue[next] : 0;
+            helds[options++] = 1;
+        }
+        else if (!hold and next + 1 < size and queue[next + 1] != queue[next])
+        {
+            shapeIds[options] = queue[next + 1];
+            nexts[options] = next + 2;
+            holds[options] = queue[next];
+            helds[options++] = 1;
+        }
+        return options;
+    }
+
+    // Highest row a piece may use: a perfect clear in depth pieces fills exactly (cells + 4 depth) / 10 rows
+    int getLimitRow(const Board &board, int depth)
+    {
+        return goal == PerfectClear ? Grid::rows - (board.cells + 4 * depth) / Grid::cols : 0;
+    }
+
+    // Cheap necessary conditions; false means no sequence of depth pieces can succeed from here
+    bool isPromising(const Board &board, int next, int hold, int depth, int need)
+    {
+        int available[8] = {0};
+        available[hold]++;
+        for (int i = next; i < (int)queue.size() and i <= next + depth; i++)
+        {
+            available[queue[i]]++;
+        }
+
+        if (goal == TSpins)
+        {
+            return need <= available[Tetromino::Shape_T];
+        }
+
+        int limitRow = getLimitRow(board, depth);
+        for (int y = 0; y < limitRow; y++)
+        {
+            if (board.rows[y])
+            {
+                return 0;
+            }
+        }
+
+        // Column parity, which line clears leave alone: full rows split evenly between even and odd
+        // columns, and only I, L, J and T pieces can tip the balance
+        int balance = 0;
+        for (int y = limitRow; y < Grid::rows; y++)
+        {
+            balance += __builtin_popcount(board.rows[y] & evenColumns) - __builtin_popcount(board.rows[y] & ~evenColumns);
+        }
+        int slack = 4 * available[Tetromino::Shape_I] +
+                    2 * (available[Tetromino::Shape_L] + available[Tetromino::Shape_J] + available[Tetromino::Shape_T]);
+        if (std::abs(balance) > slack)
+        {
+            return 0;
+        }
+
+        // Holes: columns already full up to the limit wall the board off, and each walled-off
+        // stretch needs its empty cells in fours
+        int empty = 0;
+        for (int x = 0; x < Grid::cols; x++)
+        {
+            int column = 0;
+            for (int y = limitRow; y < Grid::rows; y++)
+            {
+                column += !(board.rows[y] >> x & 1);
+            }
+            if (column == 0 and empty % 4)
+            {
+                return 0;
+            }
+            empty = column ? empty + column : 0;
+        }
+        return empty % 4 == 0;
+    }
+
+    // FNV-1a over the rows and the rest of the search state
+    unsigned long long getHash(const Board &board, int next, int hold, int depth, int need)
+    {
+        unsigned long long hash = 14695981039346656037ull;
+        for (int y = 0; y < Grid::rows; y++)
+        {
+            hash = (hash ^ board.rows[y]) * 1099511628211ull;
+        }
+        hash = (hash ^ (next | hold << 8 | depth << 16 | (unsigned)need << 24)) * 1099511628211ull;
+        return hash | 1; // 0 marks an empty slot
+    }
+
+    bool fits(const Board &board, int shapeId, int orientation, int x, int y)
+    {
+        const unsigned *rowMasks = masks[shapeId][orientation];
+        for (int r = 0; r < 4; r++)
+        {
+            if (!rowMasks[r])
+            {
+                continue;
+            }
+            if (x < 0 and (rowMasks[r] & ((1u << -x) - 1)))
+            {
+                return 0;
+            }
+            unsigned bits = x < 0 ? rowMasks[r] >> -x : rowMasks[r] << x;
+            int row = y + r;
+            if ((bits & ~fullRow) or row >= Grid::rows or (row >= 0 and (board.rows[row] & bits)))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    bool isOccupied(const Board &board, int x, int y)
+    {
+        return x < 0 or x >= Grid::cols or y >= Grid::rows or (y >= 0 and (board.rows[y] >> x & 1));
+    }
+
+    // Every distinct resting spot reachable from above the stack, lowest first, skipping spots with a cell
+    // above limitRow. A spot counts as a spin when it can be entered by a rotation
+    void findPlacements(const Board &board, int shapeId, int limitRow, std::vector<Placement> &placements)
+    {
+        struct Step
+        {
+            signed char orientation, x, y, rotated;
+        };
+        static const int capacity = 2 * 4 * spanY * spanX;
+        unsigned char seen[capacity];
+        Step steps[capacity];
+        int head = 0, tail = 0;
+        memset(seen, 0, sizeof(seen));
+        placements.clear();
+
+        // Above the highest filled row every column and orientation is open, so start there
+        int top = 0;
+        while (top < Grid::rows and !board.rows[top])
+        {
+            top++;
+        }
+        int boxSize = boxSizes[shapeId];
+        Step first = {0, (signed char)((Grid::cols - boxSize) / 2), (signed char)std::max(-2, top - boxSize), 0};
+        steps[tail++] = first;
+        seen[getStepIndex(first)] = 1;
+
+        while (head < tail)
+        {
+            Step step = steps[head++];
+            int orientation = step.orientation;
+
+            for (int dx = -1; dx <= 1; dx += 2)
+            {
+                if (fits(board, shapeId, orientation, step.x + dx, step.y))
+                {
+                    Step moved = {step.orientation, (signed char)(step.x + dx), step.y, 0};
+                    visit(moved, seen, steps, tail);
+                }
+            }
+
+            if (fits(board, shapeId, orientation, step.x, step.y + 1))
+            {
+                Step moved = {step.orientation, step.x, (signed char)(step.y + 1), 0};
+                visit(moved, seen, steps, tail);
+            }
+            else
+            {
+                addPlacement(board, shapeId, step.orientation, step.x, step.y, step.rotated, limitRow, placements);
+            }
+
+            for (int direction = -1; direction <= 1; direction += 2)
+            {
+                const int(*kicks)[2] = Logic::getKicks(shapeId, orientation, direction);
+                int turned = (orientation + direction) & 3;
+                for (int k = 0; k < 5; k++)
+                {
+                    if (fits(board, shapeId, turned, step.x + kicks[k][0], step.y - kicks[k][1]))
+                    {
+                        Step moved = {(signed char)turned, (signed char)(step.x + kicks[k][0]), (signed char)(step.y - kicks[k][1]), 1};
+                        visit(moved, seen, steps, tail);
+                        break;
+                    }
+                }
+            }
+        }
+
+        std::sort(placements.begin(), placements.end(), isLower);
+    }
+
+    template <typename Step> static int getStepIndex(const Step &step)
+    {
+        return ((step.rotated * 4 + step.orientation) * spanY + step.y - minY) * spanX + step.x + 2;
+    }
+
+    template <typename Step> static void visit(const Step &step, unsigned char *seen, Step *steps, int &tail)
+    {
+        if (step.x < -2 or step.x > Grid::cols or step.y < minY or step.y >= Grid::rows)
+        {
+            return;
+        }
+        int index = getStepIndex(step);
+        if (!seen[index])
+        {
+            seen[index] = 1;
+            steps[tail++] = step;
+        }
+    }
+
+    static bool isLower(const Placement &a, const Placement &b)
+    {
+        return a.spin != b.spin ? a.spin : a.y > b.y;
+    }
+
+    void addPlacement(const Board &board, int shapeId, int orientation, int x, int y, bool rotated, int limitRow,
+                      std::vector<Placement> &placements)
+    {
+        const unsigned *rowMasks = masks[shapeId][orientation];
+        int firstRow = 0;
+        while (!rowMasks[firstRow])
+        {
+            firstRow++;
+        }
+        if (y + firstRow < limitRow)
+        {
+            return;
+        }
+
+        // Three of the four corners around a T's center taken, counting walls and floor
+        bool spin = 0;
+        if (rotated and shapeId == Tetromino::Shape_T)
+        {
+            int corners = isOccupied(board, x, y) + isOccupied(board, x + 2, y) + isOccupied(board, x, y + 2) + isOccupied(board, x + 2, y + 2);
+            spin = corners >= 3;
+        }
+
+        // I, S, Z and O can cover the same cells from different orientations; keep one of each
+        for (size_t i = 0; i < placements.size(); i++)
+        {
+            if (placements[i].spin == spin and isSameCells(placements[i], shapeId, orientation, x, y))
+            {
+                return;
+            }
+        }
+
+        Placement placement = {shapeId, orientation, x, y, 0, spin, 0};
+        placements.push_back(placement);
+    }
+
+    bool isSameCells(const Placement &placement, int shapeId, int orientation, int x, int y)
+    {
+        for (int r = -3; r < 4; r++)
+        {
+            if (getCellBits(shapeId, orientation, x, r) != getCellBits(placement.shapeId, placement.orientation, placement.x, r + y - placement.y))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    // Board columns covered in box row r, as a mask shifted to column x
+    unsigned getCellBits(int shapeId, int orientation, int x, int r)
+    {
+        if (r < 0 or r > 3)
+        {
+            return 0;
+        }
+        unsigned mask = masks[shapeId][orientation][r];
+        return x < 0 ? mask >> -x : mask << x;
+    }
+
+    Board place(const Board &board, Placement &placement)
+    {
+        Board result = board;
+        for (int r = 0; r < 4; r++)
+        {
+            unsigned bits = getCellBits(placement.shapeId, placement.orientation, placement.x, r);
+            if (bits)
+            {
+                result.rows[placement.y + r] |= bits;
+            }
+        }
+
+        int write = Grid::rows - 1;
+        placement.lines = 0;
+        for (int read = Grid::rows - 1; read >= 0; read--)
+        {
+            if (result.rows[read] == fullRow)
+            {
+                placement.lines++;
+            }
+            else
+            {
+                result.rows[write--] = result.rows[read];
+            }
+        }
+        while (write >= 0)
+        {
+            result.rows[write--] = 0;
+        }
+        result.cells = board.cells + 4 - placement.lines * Grid::cols;
+        return result;
+    }
+};
+
+// Solver puzzle sets: puzzle packs, or random sets of bag queues on an empty board
+class SolverBench
+{
+public:
+    struct Puzzle
+    {
+        std::vector<std::string> rows;
+        std::vector<int> queue;
+        int held;
+    };
+
+    static bool load(const char *filename, std::vector<Puzzle> &puzzles)
+    {
+        PuzzlePack pack;
+        if (!pack.open(filename))
+        {
+            return 0;
+        }
+
+        for (int i = 0; i < pack.getCount(); i++)
+        {
+            PuzzlePack::Puzzle source;
+            pack.get(i, source);
+            Puzzle puzzle;
+            for (int r = 0; r < source.rowCount; r++)
+            {
+                puzzle.rows.push_back(std::string(source.rows[r].data, source.rows[r].size));
+            }
+            for (size_t k = 0; k < source.queue.size; k++)
+            {
+                if (PieceQueue::fromLetter(source.queue.data[k]))
+                {
+                    puzzle.queue.push_back(PieceQueue::fromLetter(source.queue.data[k]));
+                }
+            }
+            puzzle.held = source.held;
+            puzzles.push_back(puzzle);
+        }
+        return 1;
+    }
+
+    static void generate(int count, int length, unsigned seed, std::vector<Puzzle> &puzzles)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            Random random(seed + i);
+            PieceQueue queue(&random);
+            queue.reset();
+
+            Puzzle puzzle;
+            puzzle.held = 0;
+            for (int k = 0; k < length; k++)
+            {
+                puzzle.queue.push_back(PieceQueue::getShapeId(queue.pop()));
+            }
+            puzzles.push_back(puzzle);
+        }
+    }
+
+    static int run(const std::vector<Puzzle> &puzzles, int goal, int maxPieces, int threads)
+    {
+        const char *letters = " OSZILJT";
+        int solved = 0;
+        double total = 0, slowest = 0;
+        unsigned long long nodes = 0;
+
+        for (size_t p = 0; p < puzzles.size(); p++)
+        {
+            const Puzzle &puzzle = puzzles[p];
+            Grid grid;
+            grid.clear();
+            for (size_t r = 0; r < puzzle.rows.size() and r < (size_t)Grid::rows; r++)
+            {
+                int y = Grid::rows - puzzle.rows.size() + r;
+                for (int x = 0; x < Grid::cols and x < (int)puzzle.rows[r].size(); x++)
+                {
+                    grid.grid[y][x] = puzzle.rows[r][x] == '#' ? 8 : 0;
+                }
+                grid.updateRowMask(y);
+            }
+
+            Solver solver(&grid, puzzle.queue, puzzle.held);
+            Solver::Result result = solver.solve(goal, maxPieces, threads);
+            solved += result.solved;
+            total += result.seconds;
+            slowest = std::max(slowest, result.seconds);
+            nodes += result.nodes;
+
+            std::cout << "Puzzle " << p + 1 << ": ";
+            if (result.solved)
+            {
+                std::cout << (goal == Solver::TSpins ? "" : "perfect clear, ") << result.placements.size() << " pieces";
+                if (goal == Solver::TSpins)
+                {
+                    std::cout << ", " << result.tSpins << " T-spins";
+                }
+            }
+            else
+            {
+                std::cout << "no solution";
+            }
+            std::cout << ", " << result.seconds << " s, " << result.nodes << " nodes";
+
+            // Each piece as shape, orientation and box column, H when held and * on a spin
+            for (size_t i = 0; i < result.placements.size(); i++)
+            {
+                const Solver::Placement &placement = result.placements[i];
+                std::cout << (i ? " " : ": ") << (placement.held ? "H" : "") << letters[placement.shapeId] << placement.orientation << "@"
+                          << placement.x << (placement.spin and placement.lines ? "*" : "");
+            }
+            std::cout << "\n";
+        }
+
+        if (!puzzles.empty())
+        {
+            std::cout << solved << "/" << puzzles.size() << " solved (" << 100.0 * solved / puzzles.size() << "%), mean " << total / puzzles.size()
+                      << " s, slowest " << slowest << " s, " << (total > 0 ? nodes / total : 0) << " nodes/s\n";
+        }
+        return puzzles.empty() ? 1 : 0;
+    }
+};
+
+// Times one busy frame of effects, the ghost, 40 flying blocks with trails and a double-line flash,
+// drawn shape by shape with the per-pixel blend against the compositor's four-pixel blend
+class EffectsBench
+{
+public:
+    struct Rect
+    {
+        int x, y, w, h;
+        sf::Color color;
+    };
+
+    static int run(int frames, unsigned seed)
+    {
+        const int tile = View::tileSize;
+        Random random(seed);
+        std::vector<Rect> scene;
+        for (int i = 0; i < 4; i++)
+        {
+            Rect ghost = {(3 + i) * tile + 1, 18 * tile + 1, tile - 1, tile - 1, Colors::getColor(Colors::Grey, 80)};
+            scene.push_back(ghost);
+        }
+        for (int i = 0; i < 40; i++)
+        {
+            int x = random.next(Grid::cols * tile), y = random.next(Grid::rows * tile);
+            for (int k = FxBlock::trailLength; k >= 0; k--)
+            {
+                Rect block = {x - 6 * k, y + 4 * k, tile - 1, tile - 1, Colors::getColor(9 + random.next(7), k ? 120 * (FxBlock::trailLength + 1 - k) / (FxBlock::trailLength + 1) : 200)};
+                scene.push_back(block);
+            }
+        }
+        for (int r = 16; r < 18; r++)
+        {
+            Rect flash = {1, r * tile + 1, Grid::cols * tile - 1, tile - 1, sf::Color(255, 255, 255, 120)};
+            scene.push_back(flash);
+        }
+
+        FrameBuffer shapes(View::getEffectsWidth(), View::getWindowHeight());
+        FrameBuffer composited(View::getEffectsWidth(), View::getWindowHeight());
+        sf::Clock clock;
+        for (int f = 0; f < frames; f++)
+        {
+            shapes.clear(sf::Color::Black);
+            for (size_t i = 0; i < scene.size(); i++)
+            {
+                fillRectPerPixel(shapes, scene[i]);
+            }
+        }
+        double shapeSeconds = clock.restart().asSeconds();
+
+        for (int f = 0; f < frames; f++)
+        {
+            composited.clear(sf::Color::Black);
+            for (size_t i = 0; i < scene.size(); i++)
+            {
+                composited.fillRect(scene[i].x, scene[i].y, scene[i].w, scene[i].h, scene[i].color);
+            }
+        }
+        double compositeSeconds = clock.restart().asSeconds();
+
+        bool same = shapes.pixels == composited.pixels;
+        std::cout << frames << " frames of " << scene.size() << " shapes: per shape " << shapeSeconds * 1e6 / frames << " us/frame, composited "
+                  << compositeSeconds * 1e6 / frames << " us/frame (" << shapeSeconds / std::max(compositeSeconds, 1e-9) << "x), "
+                  << (same ? "identical pixels" : "PIXELS DIFFER") << "\n";
+        return same ? 0 : 1;
+    }
+
+    // The blend the frame buffer used before, one pixel at a time
+    static void fillRectPerPixel(FrameBuffer &frame, const Rect &rect)
+    {
+        for (int y = std::max(rect.y, 0); y < std::min(rect.y + rect.h, frame.height); y++)
+        {
+            for (int x = std::max(rect.x, 0); x < std::min(rect.x + rect.w, frame.width); x++)
+            {
+                FrameBuffer::blendPixel(&frame.pixels[(y * frame.width + x) * 4], rect.color);
+            }
+        }
+    }
+};
+
+// Replays a recorded session offscreen and hashes the frames at chosen ticks
+class ReplayCheck
+{
+public:
+    Replay replay;
+    Engine engine;
+    FrameBuffer frame;
+    View view;
+    size_t nextEvent;
+
+    ReplayCheck(Assets *assets, const Replay &replayToCheck) : replay(replayToCheck),
+                                                               engine(replay.seed),
+                                                               frame(View::getWindowWidth(), View::getWindowHeight()),
+                                                               view(&assets->font, NULL, &frame, &engine.grid, &engine.tetromino, &engine.queue, &engine.state, &engine.specialEffects),
+                                                               nextEvent(0)
+    {
+        engine.state.highscoreFilename = NULL;
+        engine.events.subscribe(&view);
+    }
+
+    sf::Int64 getLastTick()
+    {
+        return replay.events.empty() ? 0 : replay.events.back().tick;
+    }
+
+    // Plays with the recorded rules and shift timings; a replay from before they were recorded keeps
+    // the engine's
+    bool applySettings()
+    {
+        if (!replay.rules.empty())
+        {
+            std::istringstream lines(replay.rules);
+            Rules recorded;
+            if (!recorded.read(lines))
+            {
+                return 0;
+            }
+            engine.rules = recorded;
+        }
+        if (replay.dasMicroseconds >= 0)
+        {
+            engine.logic.dasMicroseconds = replay.dasMicroseconds;
+            engine.logic.arrMicroseconds = replay.arrMicroseconds;
+        }
+        return 1;
+    }
+
+    // Feeds the events recorded for this tick and simulates it
+    void step(sf::Int64 tick)
+    {
+        while (nextEvent < replay.events.size() and replay.events[nextEvent].tick <= tick)
+        {
+            engine.input.push(replay.events[nextEvent].type, tick * Logic::tickMicroseconds);
+            nextEvent++;
+        }
+        engine.logic.update(tick * Logic::tickMicroseconds);
+    }
+
+    // Runs the replay to its last event, for listeners such as statistics
+    void simulate()
+    {
+        for (sf::Int64 tick = 1; tick <= getLastTick(); tick++)
+        {
+            step(tick);
+        }
+    }
+
+    // Prints "tick exact perceptual" per frame; with a golden file, returns the number of mismatches
+    int run(std::vector<sf::Int64> frameTicks, const char *goldenFilename, const char *dumpDirectory, int tolerance)
+    {
+        std::map<sf::Int64, std::pair<sf::Uint64, sf::Uint64> > golden;
+        if (goldenFilename)
+        {
+            std::ifstream inputFile(goldenFilename);
+            sf::Int64 tick;
+            sf::Uint64 exact, perceptual;
+            while (inputFile >> std::dec >> tick >> std::hex >> exact >> perceptual)
+            {
+                golden[tick] = std::make_pair(exact, perceptual);
+            }
+        }
+
+        std::sort(frameTicks.begin(), frameTicks.end());
+        int failures = 0;
+        size_t nextFrame = 0;
+
+        for (sf::Int64 tick = 1; nextFrame < frameTicks.size(); tick++)
+        {
+            step(tick);
+
+            while (nextFrame < frameTicks.size() and frameTicks[nextFrame] == tick)
+            {
+                nextFrame++;
+                view.render();
+
+                sf::Uint64 exact = frame.exactHash();
+                sf::Uint64 perceptual = frame.perceptualHash();
+                std::cout << std::dec << tick << " " << std::hex << exact << " " << perceptual << std::dec;
+
+                if (golden.count(tick))
+                {
+                    int distance = __builtin_popcountll(golden[tick].second ^ perceptual);
+                    bool same = golden[tick].first == exact or distance <= tolerance;
+                    std::cout << (same ? " ok" : " FAIL") << " (" << distance << " bits)";
+                    failures += !same;
+                }
+                std::cout << "\n";
+
+                if (dumpDirectory)
+                {
+                    frame.saveToFile(std::string(dumpDirectory) + "/frame_" + std::to_string(tick) + ".png");
+                }
+            }
+        }
+
+        return failures;
+    }
+
+    // Re-renders the whole replay at the given rate, waiting for the encoder rather than dropping frames
+    void exportVideo(FrameEncoder &encoder, int fps)
+    {
+        sf::Int64 ticksPerFrame = 1000000 / Logic::tickMicroseconds / fps;
+
+        for (sf::Int64 tick = 1; tick <= getLastTick() + ticksPerFrame; tick++)
+        {
+            step(tick);
+
+            if (tick % ticksPerFrame == 0)
+            {
+                view.frame = encoder.acquire(1);
+                view.render();
+                encoder.submit(view.frame);
+            }
+        }
+        view.frame = &frame;
+    }
+
+    // Mixes the sounds the replay triggers, tick by tick, into a WAV file
+    bool exportAudio(SoundBank *bank, const char *filename)
+    {
+        Mixer mixer(bank);
+        WavOutput output(&mixer);
+        engine.events.subscribe(&mixer);
+
+        for (sf::Int64 tick = 1; tick <= getLastTick() + 1000; tick++)
+        {
+            step(tick);
+            output.advanceTo(tick * Logic::tickMicroseconds);
+        }
+
+        engine.events.unsubscribe(&mixer);
+        return output.save(filename);
+    }
+};
+
+// Logic thread side of the render hand-off: counts the events that invalidate a view's cached
+// geometry and publishes a snapshot of the engine after it advanced
+class SnapshotPublisher : public EventListener
+{
+public:
+    Engine *engine;
+    TripleBuffer<RenderSnapshot> snapshots;
+    unsigned hudVersion;
+    unsigned boardVersion;
+
+    SnapshotPublisher(Engine *enginePtr) : engine(enginePtr), hudVersion(1), boardVersion(1) {}
+
+    void onEvents(const GameEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            hudVersion += View::changesHud(events[i]);
+            boardVersion += View::changesBoard(events[i]);
+        }
+    }
+
+    // Copies by assignment; the slots' fly block vectors keep their capacity, so once warmed up this
+    // does not allocate
+    void publish()
+    {
+        RenderSnapshot *snapshot = snapshots.getBack();
+        snapshot->grid = engine->grid;
+        snapshot->tetromino = engine->tetromino;
+        snapshot->queue = engine->queue;
+        snapshot->state = engine->state;
+        snapshot->state.grid = &snapshot->grid;
+        snapshot->state.tetromino = &snapshot->tetromino;
+        snapshot->state.queue = &snapshot->queue;
+        snapshot->specialEffects = engine->specialEffects;
+        snapshot->hudVersion = hudVersion;
+        snapshot->boardVersion = boardVersion;
+        snapshots.publish();
+    }
+};
+
+// Paces the game loop so input is polled as late as possible before the frame is shown: it learns how
+// long a frame takes from polling to presenting and sleeps until just that long before the next
+// deadline, with coarse sleeps first and a short yielding spin at the end
+class FramePacer
+{
+public:
+    enum Mode
+    {
+        VSync,    // display() waits for the vertical blank, the pacer sleeps before polling
+        Uncapped, // no waiting at all
+        Fixed     // the pacer's own deadlines at hz
+    };
+
+    static const int marginMicroseconds = 1000; // slack left between the expected cost and the deadline
+    static const int spinMicroseconds = 2000;   // the last stretch before waking, waited by yielding
+
+    sf::Clock *clock;
+    int mode;
+    int hz;
+    sf::Int64 period;   // between presents; learned from the display under vsync
+    sf::Int64 deadline; // when the next frame should be presented
+    sf::Int64 frameStart;
+    sf::Int64 renderEnd;
+    sf::Int64 lastPresent;
+
+    // Running averages in microseconds
+    float cost;          // polling through rendering, plus presenting when uncapped
+    float costDeviation;
+    float interval;      // between presents
+    float slept;
+    float blocked;       // from the end of rendering to the frame being shown
+    float pollToPresent;
+
+    FramePacer(sf::Clock *clockPtr, int pacingMode, int rate)
+        : clock(clockPtr), mode(pacingMode), hz(std::max(rate, 1)), period(1000000 / hz), deadline(0), frameStart(0), renderEnd(0), lastPresent(0),
+          cost(0), costDeviation(0), interval(period), slept(0), blocked(0), pollToPresent(0)
+    {
+    }
+
+    static float average(float value, float sample)
+    {
+        return value + (sample - value) / 16;
+    }
+
+    void configure(sf::RenderWindow &window)
+    {
+        window.setFramerateLimit(0);
+        window.setVerticalSyncEnabled(mode == VSync);
+    }
+
+    sf::Int64 now()
+    {
+        return clock->getElapsedTime().asMicroseconds();
+    }
+
+    // Waits until the latest moment that still leaves room for an average frame plus some deviation
+    void waitForFrame()
+    {
+        sf::Int64 start = now();
+        if (mode != Uncapped)
+        {
+            sf::Int64 target = mode == VSync ? lastPresent + period : deadline;
+            sf::Int64 wakeAt = target - (sf::Int64)(cost + 2 * costDeviation) - marginMicroseconds;
+            if (wakeAt - start > spinMicroseconds)
+            {
+                sf::sleep(sf::microseconds(wakeAt - start - spinMicroseconds));
+            }
+            while (now() < wakeAt)
+            {
+                std::this_thread::yield();
+            }
+        }
+        frameStart = now();
+        slept = average(slept, frameStart - start);
+    }
+
+    // In fixed mode a finished frame is held until its deadline, so frames are shown evenly spaced
+    void rendered()
+    {
+        renderEnd = now();
+        while (mode == Fixed and now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+    }
 
-    GameState state;
+    void presented()
+    {
+        sf::Int64 present = now();
+        float frameCost = mode == Uncapped ? present - frameStart : renderEnd - frameStart;
+        costDeviation = average(costDeviation, std::abs(frameCost - cost));
+        cost = average(cost, frameCost);
+        blocked = average(blocked, present - renderEnd);
+        pollToPresent = average(pollToPresent, present - frameStart);
+
+        sf::Int64 elapsed = present - lastPresent;
+        interval = average(interval, elapsed);
+        if (mode == VSync and elapsed < period * 3 / 2)
+        {
+            period = average(period, elapsed); // a missed blank would read as two periods
+        }
 
-    SpecialEffects specialEffects;
+        deadline += period;
+        if (deadline < present)
+        {
+            deadline = present + period; // fell behind: restart the cadence instead of rushing frames
+        }
+        lastPresent = present;
+    }
+
+    // An input arrives on average half a frame before it is polled, then waits for the frame to show
+    float getLatency()
+    {
+        return interval / 2 + pollToPresent;
+    }
+
+    std::string getReport()
+    {
+        char text[192];
+        const char *names[] = {"vsync", "uncapped", "fixed"};
+        snprintf(text, sizeof(text), "%s %d Hz: %.1f fps, render %.2f ms, slept %.2f ms\npresent wait %.2f ms, poll to present %.2f ms\ninput to photon ~%.1f ms",
+                 names[mode], mode == Fixed ? hz : (int)(1000000 / std::max<sf::Int64>(period, 1)), 1e6f / std::max(interval, 1.0f), cost / 1000, slept / 1000,
+                 blocked / 1000, pollToPresent / 1000, getLatency() / 1000);
+        return text;
+    }
+};
+
+class Tetris
+{
+public:
+    sf::RenderWindow window;
+
+    Engine engine;
+
+    SoundBank soundBank;
+    Mixer mixer;
+    AudioStream audioStream;
 
     View view;
-    Input input;
-    Logic logic;
+    View captureView;
+    FrameEncoder *encoder; // captures every displayed frame when set
+    Assets *assets;
+    sf::Clock clock;
+    FramePacer pacer;
+
+    // Logic runs on its own thread at the tick rate and hands snapshots to this one, which only
+    // pumps window events into the input queue and renders
+    SnapshotPublisher publisher;
+    std::atomic<bool> running;
+    std::thread logicThread;
+
+    // windowScale multiplies the layout's size for the initial window, 0 picks the largest that fits the desktop
+    Tetris(Assets *assetsPtr, unsigned seed, int windowScale = 1, int pacing = FramePacer::Fixed, int hz = 60)
+        : window(sf::VideoMode(View::getWindowWidth() * getInitialScale(windowScale), View::getWindowHeight() * getInitialScale(windowScale)), "Tetris"),
+          engine(seed),
+          mixer(&soundBank),
+          audioStream(&mixer),
+          view(&assetsPtr->font, &window, NULL, &engine.grid, &engine.tetromino, &engine.queue, &engine.state, &engine.specialEffects),
+          captureView(&assetsPtr->font, NULL, NULL, &engine.grid, &engine.tetromino, &engine.queue, &engine.state, &engine.specialEffects),
+          encoder(NULL),
+          assets(assetsPtr),
+          pacer(&clock, pacing, hz),
+          publisher(&engine),
+          running(0)
+    {
+        resize(window.getSize().x, window.getSize().y);
+        engine.events.subscribe(&mixer);
+        engine.events.subscribe(&publisher);
+    }
+
+    static int getInitialScale(int windowScale)
+    {
+        if (windowScale > 0)
+        {
+            return windowScale;
+        }
+        sf::VideoMode desktop = sf::VideoMode::getDesktopMode();
+        return std::max(1, (int)std::min(desktop.width / View::getWindowWidth(), desktop.height / View::getWindowHeight()));
+    }
 
-    Tetris() : window(sf::VideoMode(View::getWindowWidth(), View::getWindowHeight()), "Tetris"),
-               state(&grid, &tetromino, &nextTetromino),
-               view(&window, &grid, &tetromino, &nextTetromino, &state, &specialEffects),
-               logic(&grid, &input, &tetromino, &state, &nextTetromino, &specialEffects)
+    void resize(unsigned width, unsigned height)
     {
-        state.currentState = GameState::Title;
-        nextTetromino = Generator::getTetromino();
+        view.resize(width, height);
+        assets->prewarmGlyphs(view.scale);
+    }
+
+    // Advances the engine every tick, waking on a fixed schedule, and publishes what it simulated;
+    // input pushed by the render thread is picked up at the next tick however long display() blocks
+    void logicLoop()
+    {
+        sf::Int64 wake = clock.getElapsedTime().asMicroseconds();
+        sf::Int64 publishedTick = engine.logic.tickCount;
+        while (running.load(std::memory_order_acquire))
+        {
+            engine.logic.update(clock.getElapsedTime().asMicroseconds());
+            if (engine.logic.tickCount != publishedTick)
+            {
+                publisher.publish();
+                publishedTick = engine.logic.tickCount;
+            }
+
+            wake += Logic::tickMicroseconds;
+            sf::Int64 now = clock.getElapsedTime().asMicroseconds();
+            if (wake > now)
+            {
+                sf::sleep(sf::microseconds(wake - now));
+            }
+            else
+            {
+                wake = now; // fell behind; catching up is Logic::update's job
+            }
+        }
     }
 
     void run()
     {
-        sf::Clock clock;
-        window.setFramerateLimit(60);
+        pacer.configure(window);
+        window.setKeyRepeatEnabled(false); // auto-repeat is handled by Logic
+        audioStream.play();
+        sf::Int64 nextReport = 0;
+
+        publisher.publish(); // a resumed game is on screen before the first tick
+        running.store(1, std::memory_order_release);
+        logicThread = std::thread(&Tetris::logicLoop, this);
 
         while (window.isOpen())
         {
-            float time = clock.getElapsedTime().asSeconds();
-            clock.restart();
+            pacer.waitForFrame();
 
             sf::Event e;
             while (window.pollEvent(e))
             {
+                sf::Int64 now = clock.getElapsedTime().asMicroseconds();
+
                 switch (e.type)
                 {
                 case sf::Event::Closed:
                     window.close();
                     break;
 
+                case sf::Event::Resized:
+                    resize(e.size.width, e.size.height);
+                    break;
+
                 case sf::Event::KeyPressed:
                     if (e.key.code == sf::Keyboard::Space)
                     {
-                        input.spacebar = 1;
+                        engine.input.push(InputEvent::HardDrop, now);
                     }
                     else if (e.key.code == sf::Keyboard::Right)
                     {
-                        input.moveX = 1;
+                        engine.input.push(InputEvent::MoveRight, now);
                     }
                     else if (e.key.code == sf::Keyboard::Left)
                     {
-                        input.moveX = -1;
+                        engine.input.push(InputEvent::MoveLeft, now);
                     }
                     else if (e.key.code == sf::Keyboard::Up)
                     {
-                        input.rotate = 1;
+                        engine.input.push(InputEvent::Rotate, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::Z)
+                    {
+                        engine.input.push(InputEvent::RotateCounterClockwise, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::C or e.key.code == sf::Keyboard::LShift)
+                    {
+                        engine.input.push(InputEvent::Hold, now);
                     }
                     else if (e.key.code == sf::Keyboard::Down)
                     {
-                        input.fastDrop = 1;
+                        engine.input.push(InputEvent::SoftDropPressed, now);
                     }
                     else if (e.key.code == sf::Keyboard::P)
                     {
-                        input.paused = 1;
+                        engine.input.push(InputEvent::Pause, now);
                     }
                     else if (e.key.code == sf::Keyboard::Q)
                     {
@@ -1349,18 +7107,34 @@ public:
                     }
                     else if (e.key.code == sf::Keyboard::S)
                     {
-                        input.shadowSwitch = 1;
+                        engine.input.push(InputEvent::ShadowSwitch, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::N)
+                    {
+                        engine.input.push(InputEvent::NextPuzzle, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::R)
+                    {
+                        engine.input.push(InputEvent::RestartPuzzle, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::F3)
+                    {
+                        view.overlayEnabled = !view.overlayEnabled;
                     }
                     break;
 
                 case sf::Event::KeyReleased:
                     if (e.key.code == sf::Keyboard::Down)
                     {
-                        input.fastDrop = 0;
+                        engine.input.push(InputEvent::SoftDropReleased, now);
                     }
-                    else if (e.key.code == sf::Keyboard::P)
+                    else if (e.key.code == sf::Keyboard::Right)
+                    {
+                        engine.input.push(InputEvent::MoveRightReleased, now);
+                    }
+                    else if (e.key.code == sf::Keyboard::Left)
                     {
-                        input.paused = 0;
+                        engine.input.push(InputEvent::MoveLeftReleased, now);
                     }
                     break;
 
@@ -1369,16 +7143,456 @@ public:
                 }
             }
 
-            state.update(input);
-            logic.update(time);
+            RenderSnapshot *snapshot = publisher.snapshots.acquire();
+            view.show(snapshot);
+
+            // The overlay text changes four times a second, not every frame
+            if (view.overlayEnabled and pacer.frameStart >= nextReport)
+            {
+                view.overlay = pacer.getReport();
+                nextReport = pacer.frameStart + 250000;
+            }
             view.render();
+            pacer.rendered();
+            view.present();
+            pacer.presented();
+
+            if (encoder)
+            {
+                captureView.frame = encoder->acquire(0);
+                if (captureView.frame)
+                {
+                    captureView.show(snapshot);
+                    captureView.render();
+                    encoder->submit(captureView.frame);
+                }
+            }
         }
+
+        running.store(0, std::memory_order_release);
+        logicThread.join();
     }
 };
 
-int main()
+#ifdef TETRIS_FUZZ
+// libFuzzer entry point, built by make fuzz in place of the game; aborting keeps the failing input
+extern "C" int LLVMFuzzerTestOneInput(const sf::Uint8 *data, size_t size)
+{
+    Fuzzer fuzzer;
+    if (!fuzzer.runInput(data, size))
+    {
+        std::cerr << fuzzer.failure << "\n";
+        abort();
+    }
+    return 0;
+}
+#else
+int main(int argc, char *argv[])
 {
-    Tetris game;
+    unsigned seed = time(NULL);
+    int das = -1, arr = -1;
+    const char *recordFilename = NULL;
+    const char *replayFilename = NULL;
+    const char *goldenFilename = NULL;
+    const char *dumpDirectory = NULL;
+    int tolerance = 0;
+    std::vector<sf::Int64> frameTicks;
+    const char *videoFilename = NULL;
+    int fps = 50;
+    const char *audioFilename = NULL;
+    const char *statsDirectory = NULL;
+    const char *rulesFilename = NULL;
+    int preview = -1;
+    const char *saveFilename = "save.dat";
+    const char *trainDirectory = NULL;
+    size_t transitions = 1000000;
+    int envs = 64;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int policy = TrainingEnv::Greedy;
+    int wideCheckSteps = 0;
+    int fuzzIterations = 0;
+    const char *solveFilename = NULL;
+    int solveGoal = Solver::PerfectClear;
+    int solvePieces = 10;
+    int puzzleCount = 20;
+    int windowScale = 1;
+    int effectsBenchFrames = 0;
+    int pacing = FramePacer::Fixed;
+    int pacingHz = 60;
+    const char *spawnPolicy = NULL;
+    const char *packFilename = NULL;
+    const char *mode = NULL;
+
+    // Every option takes one value
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 == argc)
+        {
+            std::cerr << "Missing a value after " << argv[i] << "\n";
+            return 1;
+        }
+        if (strcmp(argv[i], "--das") == 0)
+        {
+            das = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--arr") == 0)
+        {
+            arr = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            seed = strtoul(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--record") == 0)
+        {
+            recordFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--replay") == 0)
+        {
+            replayFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--frames") == 0)
+        {
+            for (char *tick = strtok(argv[i + 1], ","); tick; tick = strtok(NULL, ","))
+            {
+                frameTicks.push_back(atoll(tick));
+            }
+        }
+        else if (strcmp(argv[i], "--golden") == 0)
+        {
+            goldenFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--dump") == 0)
+        {
+            dumpDirectory = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0)
+        {
+            tolerance = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            statsDirectory = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--rules") == 0)
+        {
+            rulesFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--preview") == 0)
+        {
+            preview = std::max(0, std::min(atoi(argv[i + 1]), (int)PieceQueue::maxPreview));
+        }
+        else if (strcmp(argv[i], "--save") == 0)
+        {
+            saveFilename = strcmp(argv[i + 1], "none") == 0 ? NULL : argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--train") == 0)
+        {
+            trainDirectory = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--transitions") == 0)
+        {
+            transitions = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--envs") == 0)
+        {
+            envs = std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            threads = std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--policy") == 0)
+        {
+            policy = strcmp(argv[i + 1], "uniform") == 0 ? TrainingEnv::Uniform : TrainingEnv::Greedy;
+        }
+        else if (strcmp(argv[i], "--wide-check") == 0)
+        {
+            wideCheckSteps = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--fuzz") == 0)
+        {
+            fuzzIterations = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--solve") == 0)
+        {
+            solveFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--goal") == 0)
+        {
+            solveGoal = strcmp(argv[i + 1], "tspin") == 0 ? Solver::TSpins : Solver::PerfectClear;
+        }
+        else if (strcmp(argv[i], "--pieces") == 0)
+        {
+            solvePieces = std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--puzzles") == 0)
+        {
+            puzzleCount = std::max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--effects-bench") == 0)
+        {
+            effectsBenchFrames = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--pacing") == 0)
+        {
+            pacing = strcmp(argv[i + 1], "vsync") == 0 ? FramePacer::VSync : strcmp(argv[i + 1], "uncapped") == 0 ? FramePacer::Uncapped : FramePacer::Fixed;
+            pacingHz = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 60;
+        }
+        else if (strcmp(argv[i], "--spawn") == 0)
+        {
+            spawnPolicy = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--pack") == 0)
+        {
+            packFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--mode") == 0)
+        {
+            mode = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--scale") == 0)
+        {
+            windowScale = std::max(0, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--audio") == 0)
+        {
+            audioFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--video") == 0)
+        {
+            videoFilename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--fps") == 0)
+        {
+            fps = std::max(1, std::min(atoi(argv[i + 1]), 1000));
+        }
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    Rules rules;
+    if (rulesFilename and !rules.load(rulesFilename))
+    {
+        std::cerr << "Cannot read rules " << rulesFilename << "\n";
+        return 1;
+    }
+    if (spawnPolicy)
+    {
+        rules.spawnPolicy = Rules::getSpawnPolicy(spawnPolicy);
+    }
+    if (mode)
+    {
+        rules.mode = Rules::getMode(mode);
+    }
+
+    PuzzlePack pack;
+    if (packFilename and (!pack.open(packFilename) or pack.getCount() == 0))
+    {
+        std::cerr << "Cannot read puzzles " << packFilename << "\n";
+        return 1;
+    }
+    PuzzlePack *puzzles = packFilename ? &pack : NULL;
+
+    if (effectsBenchFrames > 0)
+    {
+        return EffectsBench::run(effectsBenchFrames, seed);
+    }
+
+    if (wideCheckSteps > 0)
+    {
+        return WideCheck::run(wideCheckSteps, seed, rules) ? 1 : 0;
+    }
+
+    if (fuzzIterations > 0)
+    {
+        return Fuzzer::run(fuzzIterations, seed) ? 1 : 0;
+    }
+
+    if (solveFilename)
+    {
+        std::vector<SolverBench::Puzzle> puzzles;
+        if (strcmp(solveFilename, "random") == 0)
+        {
+            SolverBench::generate(puzzleCount, solvePieces + 1, seed, puzzles);
+        }
+        else if (!SolverBench::load(solveFilename, puzzles))
+        {
+            std::cerr << "Cannot read puzzles " << solveFilename << "\n";
+            return 1;
+        }
+        return SolverBench::run(puzzles, solveGoal, solvePieces, threads);
+    }
+
+    if (trainDirectory)
+    {
+        return TrainingExport::run(trainDirectory, transitions, envs, threads, policy, seed, rules) ? 0 : 1;
+    }
+
+    Assets assets;
+    if (!assets.load())
+    {
+        std::cerr << "Cannot load the embedded font\n";
+        return 1;
+    }
+
+    StatsWriter *statsWriter = NULL;
+    if (statsDirectory)
+    {
+        statsWriter = new StatsWriter(statsDirectory);
+        if (!statsWriter->isOpen())
+        {
+            std::cerr << "Cannot write statistics to " << statsDirectory << "\n";
+            return 1;
+        }
+    }
+
+    if (replayFilename)
+    {
+        Replay replay;
+        if (!replay.load(replayFilename))
+        {
+            std::cerr << "Cannot read replay " << replayFilename << "\n";
+            return 1;
+        }
+        ReplayCheck check(&assets, replay);
+        check.engine.rules = rules;
+        check.engine.state.puzzles = puzzles;
+        if (das >= 0)
+        {
+            check.engine.logic.dasMicroseconds = das * 1000;
+        }
+        if (arr >= 0)
+        {
+            check.engine.logic.arrMicroseconds = arr * 1000;
+        }
+        if (!check.applySettings())
+        {
+            std::cerr << "Cannot read the rules of replay " << replayFilename << "\n";
+            return 1;
+        }
+        if (preview >= 0)
+        {
+            check.view.previewCount = preview;
+        }
+
+        if (statsWriter)
+        {
+            Stats stats(&check.engine.grid, statsWriter);
+            check.engine.events.subscribe(&stats);
+            check.simulate();
+            stats.finish();
+            delete statsWriter;
+            return 0;
+        }
+
+        if (audioFilename)
+        {
+            SoundBank bank;
+            return check.exportAudio(&bank, audioFilename) ? 0 : 1;
+        }
+        if (videoFilename)
+        {
+            FrameEncoder encoder(videoFilename, check.frame.width, check.frame.height, fps);
+            if (!encoder.isOpen())
+            {
+                std::cerr << "Cannot write " << videoFilename << "\n";
+                return 1;
+            }
+            check.exportVideo(encoder, fps);
+            return 0;
+        }
+        return check.run(frameTicks, goldenFilename, dumpDirectory, tolerance) ? 1 : 0;
+    }
+
+    Tetris game(&assets, seed, windowScale, pacing, pacingHz);
+    game.engine.rules = rules;
+    game.engine.state.puzzles = puzzles;
+    if (preview >= 0)
+    {
+        game.view.previewCount = preview;
+        game.captureView.previewCount = preview;
+    }
+    if (das >= 0)
+    {
+        game.engine.logic.dasMicroseconds = das * 1000;
+    }
+    if (arr >= 0)
+    {
+        game.engine.logic.arrMicroseconds = arr * 1000;
+    }
+
+    Stats *stats = NULL;
+    if (statsWriter)
+    {
+        stats = new Stats(&game.engine.grid, statsWriter);
+        game.engine.events.subscribe(stats);
+    }
+
+    Replay replay(seed);
+    if (recordFilename)
+    {
+        replay.dasMicroseconds = game.engine.logic.dasMicroseconds;
+        replay.arrMicroseconds = game.engine.logic.arrMicroseconds;
+        std::ostringstream lines;
+        game.engine.rules.write(lines);
+        replay.rules = lines.str();
+        game.engine.logic.recorder = &replay;
+    }
+
+    FrameEncoder *encoder = NULL;
+    if (videoFilename)
+    {
+        encoder = new FrameEncoder(videoFilename, View::getWindowWidth(), View::getWindowHeight(), 60);
+        game.encoder = encoder;
+    }
+
+    // A recording has to start from its seed, so it never resumes a saved game; a saved game does
+    // not hold the puzzle pack, so puzzle mode neither resumes nor saves one
+    SaveFile saveFile;
+    Checkpoint *checkpoint = NULL;
+    if (saveFilename and !puzzles and saveFile.open(saveFilename))
+    {
+        checkpoint = new Checkpoint(&game.engine, &saveFile);
+        if (!recordFilename)
+        {
+            checkpoint->resume();
+        }
+        game.engine.events.subscribe(checkpoint);
+    }
+
     game.run();
+    game.engine.state.saveHighScore(); // a game still in progress when the window closed
+
+    if (checkpoint)
+    {
+        checkpoint->save(); // the game in progress when the window closed
+        delete checkpoint;
+    }
+
+    if (encoder)
+    {
+        encoder->close();
+        if (encoder->droppedFrames)
+        {
+            std::cerr << encoder->droppedFrames << " frames dropped while capturing\n";
+        }
+        delete encoder;
+    }
+
+    if (stats)
+    {
+        delete stats;
+        delete statsWriter;
+    }
+
+    if (recordFilename)
+    {
+        replay.save(recordFilename);
+    }
     return 0;
 }
+#endif